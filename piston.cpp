@@ -1,23 +1,421 @@
 #include "raylib.h"
+#include "rlgl.h"
 #define RAYGUI_IMPLEMENTATION
 #include "dependencies/raygui.h"
 // I prefer math types and functions from GLSL, therefore I use GLM
 // instead of whatever math functionality provided by Raylib.
 #include "glm/gtx/matrix_transform_2d.hpp"
 #include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define PISTON_IO_URING
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#define PISTON_PERF_EVENTS
+#endif
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 using namespace glm;
 
-const float EPSILON = 0.001f;
+constexpr float EPSILON = 0.001f;
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
 const int TARGET_FPS = 60;
+// Simulated time of a single simulation step in seconds
+const float SIMULATION_STEP = 1.f / 60;
 
 bool is_zero(const float a) { return abs(a) < EPSILON; }
 float square(const float a) { return a * a; }
+double square(const double a) { return a * a; }
+
+// ======================= PROFILER =======================
+
+// Frame profiler, compiled in only with PISTON_PROFILER defined. Without it the
+// PROFILE_* macros expand to nothing, so the profiler costs nothing at all.
+//
+// Scoped timers push events into a lock-free ring buffer. Once per frame the events are
+// collected into per-stage frame times, which are shown by the overlay (toggled with F1)
+// as p50/p99 values together with the histogram of frame times. Events can also be
+// streamed into a Chrome Trace Event file for offline analysis (see trace_export).
+
+// Single-producer single-consumer queue of a fixed capacity (power of 2)
+template <typename T, uint32_t N>
+struct ring_buffer {
+  static_assert((N & (N - 1)) == 0, "Capacity must be a power of 2");
+  T items[N];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+
+  // Returns false if the buffer is full
+  bool push(const T& item) {
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) return false;
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    item = items[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+uint64_t now_nanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef PISTON_PROFILER
+struct profiler {
+  enum stage {
+    FRAME,
+    UPDATE,
+    RENDER,
+    CONTROL,
+    DRAW_COORDINATES,
+    DRAW_CRANKSHAFT,
+    DRAW_CONNECTING_ROD,
+    DRAW_PISTON,
+    DRAW_CYLINDER_GUIDES,
+    DRAW_MOTION_BLUR,
+    DRAW_TRAILS,
+    DRAW_PLOT,
+    CALCULATE_POSITIONS,
+    STAGE_COUNT
+  };
+  static constexpr const char* STAGE_NAMES[STAGE_COUNT] = {
+    "frame", "update", "render", "control", "coordinates", "crankshaft", "connecting rod", "piston", "cylinder guides",
+    "motion blur", "trails", "plot", "calculate positions"
+  };
+  // Number of frames used for percentiles and the histogram
+  static const int HISTORY = 256;
+
+  struct event {
+    uint64_t start = 0;
+    uint64_t duration = 0;
+    int stage = FRAME;
+  };
+
+  // Only the thread which used the profiler first feeds the overlay, 
+  // so the ring buffer always has a single producer
+  std::thread::id overlay_thread = std::this_thread::get_id();
+  ring_buffer<event, 16384> events;
+  uint64_t dropped_events = 0;
+  // Time spent in every stage during the current frame and during the previous frames
+  uint64_t current[STAGE_COUNT] = {};
+  float history[STAGE_COUNT][HISTORY] = {};
+  uint64_t frames = 0;
+  bool show_overlay = false;
+
+  static profiler& instance() {
+    static profiler profiler;
+    return profiler;
+  }
+
+  void record(const stage stage, const uint64_t start, const uint64_t end);
+
+  // Moves events from the ring buffer into per-stage frame times. 
+  // Event of the whole frame closes the frame.
+  void collect() {
+    event e;
+    while (events.pop(e)) {
+      current[e.stage] += e.duration;
+      if (e.stage != FRAME) continue;
+      for (int s = 0; s < STAGE_COUNT; s++) {
+        history[s][frames % HISTORY] = current[s] / 1e6f;
+        current[s] = 0;
+      }
+      frames++;
+    }
+  }
+
+  // Time in milliseconds below which the given fraction of recent frames lies
+  float percentile(const int stage, const float fraction) const {
+    const int count = (int) std::min<uint64_t>(frames, HISTORY);
+    if (count == 0) return 0;
+    float sorted[HISTORY];
+    std::copy(history[stage], history[stage] + count, sorted);
+    const int index = std::min(count - 1, (int) (fraction * count));
+    std::nth_element(sorted, sorted + index, sorted + count);
+    return sorted[index];
+  }
+};
+
+// Streams profiler events into a Chrome Trace Event JSON file, which can be opened in
+// chrome://tracing or in the Perfetto UI. Every thread records into its own ring buffer 
+// and a background thread periodically drains all of them into the file, so recording 
+// an event never waits for the disk.
+struct trace_export {
+  struct thread_buffer {
+    ring_buffer<profiler::event, 65536> events;
+    uint32_t id = 0;
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  // Protects the list of buffers, new threads register their buffers at any time
+  std::mutex mutex;
+  std::vector<std::unique_ptr<thread_buffer>> buffers;
+  std::atomic<bool> recording{false};
+  FILE* file = nullptr;
+  uint64_t origin = 0;
+  bool first_event = true;
+  std::thread thread;
+
+  static trace_export& instance() {
+    static trace_export trace_export;
+    return trace_export;
+  }
+
+  thread_buffer& local() {
+    thread_local thread_buffer* buffer = nullptr;
+    if (!buffer) {
+      std::lock_guard<std::mutex> lock(mutex);
+      buffers.push_back(std::make_unique<thread_buffer>());
+      buffer = buffers.back().get();
+      buffer->id = (uint32_t) buffers.size();
+    }
+    return *buffer;
+  }
+
+  bool open(const char* path) {
+    file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "{\"traceEvents\":[\n");
+    origin = now_nanoseconds();
+    first_event = true;
+    recording = true;
+    thread = std::thread([this]() {
+      while (recording) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        drain();
+      }
+    });
+    return true;
+  }
+
+  void record(const profiler::event& event) {
+    if (!recording.load(std::memory_order_relaxed)) return;
+    thread_buffer& buffer = local();
+    if (!buffer.events.push(event)) buffer.dropped++;
+  }
+
+  // Complete events ("ph":"X") with microsecond timestamps
+  void drain() {
+    std::lock_guard<std::mutex> lock(mutex);
+    profiler::event e;
+    for (const std::unique_ptr<thread_buffer>& buffer : buffers) {
+      while (buffer->events.pop(e)) {
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"piston\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+          first_event ? "" : ",\n", profiler::STAGE_NAMES[e.stage], (e.start - origin) / 1e3, e.duration / 1e3, buffer->id);
+        first_event = false;
+      }
+    }
+  }
+
+  void close() {
+    if (!file) return;
+    recording = false;
+    thread.join();
+    drain();
+    uint64_t dropped = 0;
+    for (const std::unique_ptr<thread_buffer>& buffer : buffers) {
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+        first_event ? "" : ",\n", buffer->id, buffer->id);
+      first_event = false;
+      dropped += buffer->dropped;
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    file = nullptr;
+    if (dropped > 0) printf("%llu profiler events were dropped\n", (unsigned long long) dropped);
+  }
+};
+
+void profiler::record(const stage stage, const uint64_t start, const uint64_t end) {
+  const event event{start, end - start, stage};
+  if (std::this_thread::get_id() == overlay_thread && !events.push(event)) dropped_events++;
+  trace_export::instance().record(event);
+}
+
+// Measures the time until the end of the scope
+struct profile_scope {
+  profiler::stage stage;
+  uint64_t start;
+  profile_scope(const profiler::stage stage): stage(stage), start(now_nanoseconds()) {}
+  ~profile_scope() { profiler::instance().record(stage, start, now_nanoseconds()); }
+};
+
+// Splits the frame into consecutive stages. Starting a stage ends the previous one,
+// the last stage and the whole frame end together with the scope.
+struct profile_frame {
+  uint64_t frame_start = now_nanoseconds();
+  uint64_t stage_start = frame_start;
+  int stage = -1;
+
+  void next(const profiler::stage next) {
+    const uint64_t now = now_nanoseconds();
+    if (stage >= 0) profiler::instance().record((profiler::stage) stage, stage_start, now);
+    stage = next;
+    stage_start = now;
+  }
+  ~profile_frame() {
+    next(profiler::FRAME);
+    profiler::instance().record(profiler::FRAME, frame_start, stage_start);
+  }
+};
+
+#define PROFILE_CONCATENATE(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCATENATE(profile_scope_, line)
+#define PROFILE_SCOPE(stage) profile_scope PROFILE_NAME(__LINE__)(profiler::stage)
+#define PROFILE_FRAME() profile_frame profile_frame_scope
+#define PROFILE_STAGE(stage) profile_frame_scope.next(profiler::stage)
+#else
+#define PROFILE_SCOPE(stage)
+#define PROFILE_FRAME()
+#define PROFILE_STAGE(stage)
+#endif
 
 // ============ ENGINE CALCULATION STRUCTURES =============
 
+// Dual number for the forward-mode automatic differentiation. Carries a value together
+// with its derivatives with respect to N independent variables. Every operation applies
+// the chain rule, so a calculation done with dual numbers returns exact derivatives
+// of the result in the same pass as the value itself.
+template <int N>
+struct dual {
+  float value = 0;
+  float derivatives[N] = {};
+
+  dual() = default;
+  dual(const float value): value(value) {}
+
+  // Independent variable with the given index
+  static dual variable(const float value, const int index) {
+    dual result(value);
+    result.derivatives[index] = 1;
+    return result;
+  }
+
+  friend dual operator+(const dual& a, const dual& b) {
+    dual result(a.value + b.value);
+    for (int i = 0; i < N; i++) result.derivatives[i] = a.derivatives[i] + b.derivatives[i];
+    return result;
+  }
+  friend dual operator-(const dual& a, const dual& b) {
+    dual result(a.value - b.value);
+    for (int i = 0; i < N; i++) result.derivatives[i] = a.derivatives[i] - b.derivatives[i];
+    return result;
+  }
+  friend dual operator-(const dual& a) { return dual(0) - a; }
+  friend dual operator*(const dual& a, const dual& b) {
+    dual result(a.value * b.value);
+    for (int i = 0; i < N; i++) result.derivatives[i] = a.derivatives[i] * b.value + a.value * b.derivatives[i];
+    return result;
+  }
+  friend dual operator/(const dual& a, const dual& b) {
+    dual result(a.value / b.value);
+    const float inverse_square = 1 / (b.value * b.value);
+    for (int i = 0; i < N; i++) 
+      result.derivatives[i] = (a.derivatives[i] * b.value - a.value * b.derivatives[i]) * inverse_square;
+    return result;
+  }
+  friend bool operator<(const dual& a, const dual& b) { return a.value < b.value; }
+
+  // Applies f(a) where f'(a) = derivative
+  friend dual chain(const dual& a, const float value, const float derivative) {
+    dual result(value);
+    for (int i = 0; i < N; i++) result.derivatives[i] = a.derivatives[i] * derivative;
+    return result;
+  }
+  friend dual cos(const dual& a) { return chain(a, cos(a.value), -sin(a.value)); }
+  friend dual sin(const dual& a) { return chain(a, sin(a.value), cos(a.value)); }
+  friend dual sqrt(const dual& a) { 
+    const float root = sqrt(a.value);
+    return chain(a, root, 0.5f / root); 
+  }
+  friend dual square(const dual& a) { return a * a; }
+  friend bool is_zero(const dual& a) { return is_zero(a.value); }
+};
+
+// Solves positions of the crankpin and the piston for the given dimensions.
+// Written for any scalar type with arithmetic operators, cos, sin and sqrt, so the same equations
+// are used with floats by engine::calculate_positions, with dual numbers by engine::sensitivities
+// and by the compiler with constant_scalar for the preset tables.
+template <typename T>
+struct slider_crank {
+  T crank_radius = 0;
+  T connecting_rod_length = 0;
+  T origin_x = 0, origin_y = 0;
+  T direction_x = 0, direction_y = 0;
+  T angle = 0;
+
+  T crankpin_x = 0, crankpin_y = 0;
+  T piston_x = 0, piston_y = 0;
+  bool exists = false;
+
+  constexpr void solve() {
+    crankpin_x = cos(angle) * crank_radius;
+    crankpin_y = sin(angle) * crank_radius;
+    const T direction_length = sqrt(square(direction_x) + square(direction_y));
+
+    const T dx = direction_x / direction_length;
+    const T dy = direction_y / direction_length;
+    const T& lx = origin_x;
+    const T& ly = origin_y;
+    const T& r = crank_radius;
+    const T& rcr = connecting_rod_length;
+    // We've already calculated those values for crankpin position
+    const T& rcos = crankpin_x;
+    const T& rsin = crankpin_y;
+
+    const T a = square(dx) + square(dy);
+    const T b = 2 * (lx * dx + ly * dy - dx * rcos - dy * rsin);
+    const T c = square(lx) + square(ly) - 2 * lx * rcos - 2 * ly * rsin - square(rcr) + square(r);
+
+    // The equation is quadratic, which means it has 2 solutions. That makes sense, considering that
+    // there are 2 possible positions for the piston 
+    // (up and down (vertical cylinder) or left and right (horizontal cylinder)). 
+    // We will always choose the largest solution that is in the positive direction of cylinder.direction.
+    // If no solutions are found, connecting rod is too short and doesn't reach the cylinder.
+    const T discriminant = square(b) - 4 * a * c;
+    const T divisor = 2 * a;
+
+    if (is_zero(divisor) || discriminant < 0) {
+      exists = false;
+      return;
+    }
+
+    const T t = (-b + sqrt(discriminant)) / divisor;
+    piston_x = lx + dx * t;
+    piston_y = ly + dy * t;
+    exists = true;
+  }
+};
+
 // Defines main components of the internal combustion engine 
 // and its dimensions as well as other parameters.
 struct engine {
@@ -51,119 +449,3269 @@ struct engine {
 
   float connecting_rod_length = 100;
 
+  // Sizes of the parts. The kinematics only depend on the joints, 
+  // but the parts are drawn and checked for clearance with these sizes.
+  struct part_sizes {
+    float bearing_radius = 10;
+    float crank_web_width = 10;
+    float connecting_rod_width = 10;
+    float piston_length = 30;
+    float piston_width = 50;
+  };
+  part_sizes parts;
+
+  // Parameters for which sensitivities of the piston position are calculated
+  enum parameter {
+    CRANK_RADIUS,
+    CONNECTING_ROD_LENGTH,
+    ORIGIN_X,
+    ORIGIN_Y,
+    DIRECTION_X,
+    DIRECTION_Y,
+    ANGLE,
+    PARAMETER_COUNT
+  };
+
+  // Piston position together with its derivatives with respect to every parameter
+  struct sensitivity {
+    vec2 position = vec2(0, 0);
+    vec2 derivatives[PARAMETER_COUNT];
+    bool exists = false;
+  };
+
+  template <typename T>
+  slider_crank<T> solver(const T (&parameters)[PARAMETER_COUNT]) const {
+    slider_crank<T> solver;
+    solver.crank_radius = parameters[CRANK_RADIUS];
+    solver.connecting_rod_length = parameters[CONNECTING_ROD_LENGTH];
+    solver.origin_x = parameters[ORIGIN_X];
+    solver.origin_y = parameters[ORIGIN_Y];
+    solver.direction_x = parameters[DIRECTION_X];
+    solver.direction_y = parameters[DIRECTION_Y];
+    solver.angle = parameters[ANGLE];
+    solver.solve();
+    return solver;
+  }
+
+  void get_parameters(float (&parameters)[PARAMETER_COUNT]) const {
+    parameters[CRANK_RADIUS] = crankshaft.crank_radius;
+    parameters[CONNECTING_ROD_LENGTH] = connecting_rod_length;
+    parameters[ORIGIN_X] = cylinder.origin.x;
+    parameters[ORIGIN_Y] = cylinder.origin.y;
+    parameters[DIRECTION_X] = cylinder.direction.x;
+    parameters[DIRECTION_Y] = cylinder.direction.y;
+    parameters[ANGLE] = crankshaft.angle;
+  }
+
   // Calculates the positon of the crankpin and the position of the piston
   void calculate_positions() {
-    crankshaft.crankpin_position = vec2{
-      cos(crankshaft.angle) * crankshaft.crank_radius, 
-      sin(crankshaft.angle) * crankshaft.crank_radius
-    };
-    const vec2 cylinder_direction = normalize(cylinder.direction);
-
-    const float& dx = cylinder_direction.x;
-    const float& dy = cylinder_direction.y;
-    const float& lx = cylinder.origin.x;
-    const float& ly = cylinder.origin.y;
-    const float& r = crankshaft.crank_radius;
-    const float& rcr = connecting_rod_length;
-    const float& alpha = crankshaft.angle;
-    // We've already calculated those values for crankpin position
-    const float& rcos = crankshaft.crankpin_position.x;
-    const float& rsin = crankshaft.crankpin_position.y;
+    PROFILE_SCOPE(CALCULATE_POSITIONS);
+    float parameters[PARAMETER_COUNT];
+    get_parameters(parameters);
+    const slider_crank<float> result = solver(parameters);
 
-    const float a = square(dx) + square(dy);
-    const float b = 2 * (lx * dx + ly * dy - dx * rcos - dy * rsin);
-    const float c = square(lx) + square(ly) - 2 * lx * rcos - 2 * ly * rsin - square(rcr) + square(r);
+    crankshaft.crankpin_position = vec2{result.crankpin_x, result.crankpin_y};
+    piston.exists = result.exists;
+    if (result.exists) piston.position = vec2{result.piston_x, result.piston_y};
+  }
 
-    // The equation is quadratic, which means it has 2 solutions. That makes sense, considering that
-    // there are 2 possible positions for the piston 
-    // (up and down (vertical cylinder) or left and right (horizontal cylinder)). 
-    // We will always choose the largest solution that is in the positive direction of cylinder.direction.
-    // If no solutions are found, connecting rod is too short and doesn't reach the cylinder.
-    const float discriminant = square(b) - 4 * a * c;
+  // Positions of the crankpin and the piston for many crank angles at once with the current dimensions.
+  // Solves the same equations as slider_crank, but the terms which don't depend on the angle are 
+  // calculated once for the whole batch. Doesn't modify the engine.
+  void calculate_positions(const int count, const float* angles, vec2* crankpins, vec2* pistons, uint8_t* exists) const {
+    PROFILE_SCOPE(CALCULATE_POSITIONS);
+    const float r = crankshaft.crank_radius;
+    const float rcr = connecting_rod_length;
+    const float lx = cylinder.origin.x;
+    const float ly = cylinder.origin.y;
+    const float direction_length = sqrt(square(cylinder.direction.x) + square(cylinder.direction.y));
+    const float dx = cylinder.direction.x / direction_length;
+    const float dy = cylinder.direction.y / direction_length;
+    const float a = square(dx) + square(dy);
     const float divisor = 2 * a;
+    const float b0 = 2 * (lx * dx + ly * dy);
+    const float c0 = square(lx) + square(ly) - square(rcr) + square(r);
 
-    if (is_zero(divisor)) {
-      piston.exists = false;
-      return;
+    for (int i = 0; i < count; i++) {
+      const float rcos = cos(angles[i]) * r;
+      const float rsin = sin(angles[i]) * r;
+      crankpins[i] = vec2{rcos, rsin};
+      const float b = b0 - 2 * (dx * rcos + dy * rsin);
+      const float c = c0 - 2 * lx * rcos - 2 * ly * rsin;
+      const float discriminant = square(b) - 4 * a * c;
+      exists[i] = !is_zero(divisor) && !(discriminant < 0);
+      if (!exists[i]) continue;
+      const float t = (-b + sqrt(discriminant)) / divisor;
+      pistons[i] = vec2{lx + dx * t, ly + dy * t};
     }
-    if (discriminant < 0) {
-      piston.exists = false;
-      return;
+  }
+
+  // Same as calculate_positions(), but also returns exact derivatives of the piston position
+  // with respect to every parameter. All of them are calculated in a single pass using dual numbers.
+  // Doesn't modify the engine.
+  sensitivity sensitivities() const {
+    float values[PARAMETER_COUNT];
+    get_parameters(values);
+    dual<PARAMETER_COUNT> parameters[PARAMETER_COUNT];
+    for (int i = 0; i < PARAMETER_COUNT; i++) 
+      parameters[i] = dual<PARAMETER_COUNT>::variable(values[i], i);
+    const slider_crank<dual<PARAMETER_COUNT>> result = solver(parameters);
+
+    sensitivity sensitivity;
+    sensitivity.exists = result.exists;
+    if (!result.exists) return sensitivity;
+    sensitivity.position = vec2{result.piston_x.value, result.piston_y.value};
+    for (int i = 0; i < PARAMETER_COUNT; i++)
+      sensitivity.derivatives[i] = vec2{result.piston_x.derivatives[i], result.piston_y.derivatives[i]};
+    return sensitivity;
+  }
+};
+
+// ================= GEOMETRY OPTIMIZATION ================
+
+// Counter-based random number generator (SplitMix64 finalizer).
+// The same (seed, counter) pair always produces the same number, so
+// results don't depend on how the work is split between threads.
+uint64_t random_bits(const uint64_t seed, const uint64_t counter) {
+  uint64_t z = seed + (counter + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Uniformly distributed number in [0, 1)
+float random_float(const uint64_t seed, const uint64_t counter) {
+  return (random_bits(seed, counter) >> 40) * (1.f / 16777216.f);
+}
+
+// Slider-crank geometry reduced to the three dimensions which define the piston motion:
+// crank radius, connecting rod length and the offset of the cylinder axis from the center
+// of the crankshaft. Where the origin lies along the cylinder axis and where the axis points
+// only shift and rotate the motion, they don't change its shape.
+struct geometry {
+  float crank_radius = 50;
+  float connecting_rod_length = 100;
+  float offset = 0;
+
+  static geometry from(const engine& engine) {
+    const vec2 direction = normalize(engine.cylinder.direction);
+    const vec2& origin = engine.cylinder.origin;
+    return geometry{
+      engine.crankshaft.crank_radius,
+      engine.connecting_rod_length,
+      direction.y * origin.x - direction.x * origin.y
+    };
+  }
+
+  // Keeps the cylinder direction, but moves the origin of the cylinder on the line
+  // which goes through the center of the crankshaft and is perpendicular to the cylinder.
+  void apply(engine& engine) const {
+    const vec2 direction = normalize(engine.cylinder.direction);
+    engine.crankshaft.crank_radius = crank_radius;
+    engine.connecting_rod_length = connecting_rod_length;
+    engine.cylinder.origin = vec2(direction.y, -direction.x) * offset;
+  }
+
+  // Piston reaches the cylinder at any crankshaft angle
+  bool valid() const {
+    return crank_radius > 0 && connecting_rod_length - crank_radius > abs(offset);
+  }
+
+  // Distances from the crankshaft center to the piston along the cylinder axis.
+  // At the dead centers the crank and the connecting rod are collinear.
+  float top_dead_center() const { 
+    return sqrt(square(connecting_rod_length + crank_radius) - square(offset)); 
+  }
+  float bottom_dead_center() const { 
+    return sqrt(square(connecting_rod_length - crank_radius) - square(offset)); 
+  }
+  float stroke() const { return top_dead_center() - bottom_dead_center(); }
+
+  // The largest angle between the connecting rod and the cylinder axis (radians)
+  float max_rod_angle() const { 
+    return asin((crank_radius + abs(offset)) / connecting_rod_length); 
+  }
+};
+
+// Searches for the geometry with the given stroke which doesn't exceed the given
+// connecting rod angle. Among all of such geometries the most compact one is chosen
+// (the one with the smallest distance between the crankshaft and the piston at TDC).
+//
+// Constraints are handled with the augmented Lagrangian method and every subproblem is
+// minimized by BFGS using analytic gradients of the dead center equations. The search
+// is started from many random geometries in parallel.
+struct geometry_optimizer {
+  float target_stroke = 100;
+  float max_rod_angle = radians(18.f);
+  geometry lower = geometry{1, 1, -50};
+  geometry upper = geometry{200, 500, 50};
+  int starts = 64;
+  uint64_t seed = 1;
+
+  struct result {
+    geometry design;
+    float cost = INFINITY;
+    int iterations = 0;
+    bool feasible = false;
+  };
+
+  // Everything is calculated relative to the target stroke, so the same tolerances work
+  // for any engine size. Takes (crank radius, rod length, offset), returns the augmented
+  // Lagrangian and its gradient. Double precision keeps the line search stable.
+  double cost(const double x[3], const double multipliers[2], const double penalty, double gradient[3]) const {
+    const double& r = x[0];
+    const double& rcr = x[1];
+    const double& e = x[2];
+    // Smooth version of abs(e), otherwise the gradient jumps at zero offset
+    const double abs_e = sqrt(e * e + 1e-8);
+    if (!(rcr - r > abs_e) || r <= 0) return INFINITY;
+
+    const double tdc = sqrt(square(rcr + r) - e * e);
+    const double bdc = sqrt(square(rcr - r) - e * e);
+    const double stroke_error = tdc - bdc - 1;
+    const double angle_error = (r + abs_e) / rcr - sin((double) max_rod_angle);
+
+    // Derivatives of TDC, BDC and sine of the max rod angle with respect to (r, rcr, e)
+    const double dtdc[3] = { (rcr + r) / tdc, (rcr + r) / tdc, -e / tdc };
+    const double dbdc[3] = { -(rcr - r) / bdc, (rcr - r) / bdc, -e / bdc };
+    const double dangle[3] = { 1 / rcr, -(r + abs_e) / (rcr * rcr), e / abs_e / rcr };
+
+    const double stroke_force = multipliers[0] + penalty * stroke_error;
+    const double angle_force = std::max(0., multipliers[1] + penalty * angle_error);
+    for (int i = 0; i < 3; i++)
+      gradient[i] = dtdc[i] + stroke_force * (dtdc[i] - dbdc[i]) + angle_force * dangle[i];
+    return tdc + multipliers[0] * stroke_error + penalty / 2 * stroke_error * stroke_error
+      + (square(angle_force) - square(multipliers[1])) / (2 * penalty);
+  }
+
+  // Minimizes the augmented Lagrangian with BFGS. Bounds are enforced by clamping,
+  // after which the approximation of the inverse Hessian is reset.
+  int minimize(double x[3], const double lo[3], const double hi[3], const double multipliers[2], const double penalty) const {
+    double h[3][3] = {{1,0,0},{0,1,0},{0,0,1}};
+    double gradient[3], next_gradient[3], next[3], direction[3];
+    double value = cost(x, multipliers, penalty, gradient);
+    int iteration = 0;
+    for (; iteration < 200; iteration++) {
+      double slope = 0;
+      for (int i = 0; i < 3; i++) {
+        direction[i] = -(h[i][0] * gradient[0] + h[i][1] * gradient[1] + h[i][2] * gradient[2]);
+        slope += direction[i] * gradient[i];
+      }
+      // Not a descent direction anymore, fall back to the gradient
+      if (slope >= 0) {
+        for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) h[i][j] = i == j;
+        for (int i = 0; i < 3; i++) direction[i] = -gradient[i];
+        slope = -(gradient[0] * gradient[0] + gradient[1] * gradient[1] + gradient[2] * gradient[2]);
+      }
+
+      // Backtracking line search with the Armijo condition
+      double step = 1, next_value = INFINITY;
+      bool clamped = false;
+      for (; step > 1e-12; step *= 0.5) {
+        clamped = false;
+        for (int i = 0; i < 3; i++) {
+          next[i] = std::clamp(x[i] + step * direction[i], lo[i], hi[i]);
+          clamped |= next[i] != x[i] + step * direction[i];
+        }
+        next_value = cost(next, multipliers, penalty, next_gradient);
+        if (next_value <= value + 1e-4 * step * slope) break;
+      }
+      if (step <= 1e-12) break;
+
+      double s[3], y[3], sy = 0, moved = 0;
+      for (int i = 0; i < 3; i++) {
+        s[i] = next[i] - x[i];
+        y[i] = next_gradient[i] - gradient[i];
+        sy += s[i] * y[i];
+        moved = std::max(moved, std::abs(s[i]));
+        x[i] = next[i];
+        gradient[i] = next_gradient[i];
+      }
+      value = next_value;
+      if (moved < 1e-10) break;
+
+      if (clamped || sy <= 1e-16) {
+        for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) h[i][j] = i == j;
+        continue;
+      }
+      // H = (I - rho s y^T) H (I - rho y s^T) + rho s s^T
+      const double rho = 1 / sy;
+      double hy[3], yhy = 0;
+      for (int i = 0; i < 3; i++) hy[i] = h[i][0] * y[0] + h[i][1] * y[1] + h[i][2] * y[2];
+      for (int i = 0; i < 3; i++) yhy += y[i] * hy[i];
+      for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++)
+        h[i][j] += rho * ((1 + rho * yhy) * s[i] * s[j] - hy[i] * s[j] - s[i] * hy[j]);
+    }
+    return iteration;
+  }
+
+  result search(const int start) const {
+    const double scale = target_stroke;
+    const double lo[3] = { lower.crank_radius / scale, lower.connecting_rod_length / scale, lower.offset / scale };
+    const double hi[3] = { upper.crank_radius / scale, upper.connecting_rod_length / scale, upper.offset / scale };
+
+    // Random valid starting point
+    double x[3];
+    for (int i = 0; i < 3; i++) 
+      x[i] = lo[i] + (hi[i] - lo[i]) * random_float(seed, start * 3 + i);
+    x[1] = std::min(hi[1], std::max(x[1], (x[0] + std::abs(x[2])) * 1.01));
+
+    result result;
+    double multipliers[2] = {0, 0};
+    double penalty = 10;
+    double gradient[3];
+    for (int round = 0; round < 20; round++) {
+      result.iterations += minimize(x, lo, hi, multipliers, penalty);
+      cost(x, multipliers, penalty, gradient);
+
+      const double r = x[0], rcr = x[1], e = x[2];
+      const double stroke_error = sqrt(square(rcr + r) - e * e) - sqrt(square(rcr - r) - e * e) - 1;
+      const double angle_error = (r + sqrt(e * e + 1e-8)) / rcr - sin((double) max_rod_angle);
+      multipliers[0] += penalty * stroke_error;
+      multipliers[1] = std::max(0., multipliers[1] + penalty * angle_error);
+      if (std::abs(stroke_error) < 1e-7 && angle_error < 1e-7) break;
+      penalty = std::min(penalty * 4, 1e6);
+    }
+
+    result.design = geometry{float(x[0] * scale), float(x[1] * scale), float(x[2] * scale)};
+    result.cost = result.design.top_dead_center();
+    result.feasible = result.design.valid()
+      && abs(result.design.stroke() - target_stroke) < target_stroke * 1e-3f
+      && result.design.max_rod_angle() < max_rod_angle * 1.001f;
+    return result;
+  }
+
+  // Runs all searches on all available cores and returns the best feasible geometry.
+  // Starting points depend only on the seed, so the result doesn't depend on the thread count.
+  result optimize() const {
+    std::vector<result> results(starts);
+    const int thread_count = max(1, min(starts, (int) std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+      threads.emplace_back([&, t]() {
+        for (int i = t; i < starts; i += thread_count) results[i] = search(i);
+      });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    result best;
+    for (const result& r : results) {
+      if (r.feasible > best.feasible || (r.feasible == best.feasible && r.cost < best.cost))
+        best = r;
+    }
+    return best;
+  }
+};
+
+// ================== TOLERANCE ANALYSIS ==================
+
+// Mean, variance and range of a stream of values. Statistics of separate
+// parts of the stream can be merged (Chan et al. parallel algorithm).
+struct statistics {
+  double count = 0;
+  double mean = 0;
+  double m2 = 0;
+  float min = INFINITY;
+  float max = -INFINITY;
+
+  double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+
+  // Adds a batch of values, but only those which are marked as valid
+  void add(const float* values, const uint8_t* valid, const int size) {
+    statistics batch;
+    double sum = 0;
+    for (int i = 0; i < size; i++) {
+      batch.count += valid[i];
+      sum += valid[i] ? values[i] : 0.f;
+    }
+    if (batch.count == 0) return;
+    batch.mean = sum / batch.count;
+    for (int i = 0; i < size; i++) {
+      if (!valid[i]) continue;
+      batch.m2 += square(values[i] - batch.mean);
+      batch.min = std::min(batch.min, values[i]);
+      batch.max = std::max(batch.max, values[i]);
+    }
+    merge(batch);
+  }
+
+  void merge(const statistics& other) {
+    if (other.count == 0) return;
+    const double total = count + other.count;
+    const double delta = other.mean - mean;
+    mean += delta * other.count / total;
+    m2 += other.m2 + square(delta) * count * other.count / total;
+    count = total;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+};
+
+// Fixed-range histogram used to estimate quantiles of a stream. Values outside
+// of the range are counted in the first and the last bins. Counts are integers,
+// so histograms can be merged in any order with the same result.
+struct histogram {
+  float lower = 0;
+  float upper = 1;
+  std::vector<uint64_t> bins = std::vector<uint64_t>(4096, 0);
+
+  void add(const float* values, const uint8_t* valid, const int size) {
+    const int last = (int) bins.size() - 1;
+    const float scale = bins.size() / (upper - lower);
+    for (int i = 0; i < size; i++) {
+      const int bin = (int) clamp((values[i] - lower) * scale, 0.f, (float) last);
+      bins[bin] += valid[i];
+    }
+  }
+
+  void merge(const histogram& other) {
+    for (size_t i = 0; i < bins.size(); i++) bins[i] += other.bins[i];
+  }
+
+  // Value below which the given fraction of values lies, interpolated inside of the bin
+  float quantile(const double fraction) const {
+    uint64_t total = 0;
+    for (uint64_t count : bins) total += count;
+    const double target = fraction * total;
+    const float width = (upper - lower) / bins.size();
+    double seen = 0;
+    for (size_t i = 0; i < bins.size(); i++) {
+      if (bins[i] > 0 && seen + bins[i] >= target)
+        return lower + width * (i + float((target - seen) / bins[i]));
+      seen += bins[i];
+    }
+    return upper;
+  }
+};
+
+// 32-bit integer hash (lowbias32 by Chris Wellons). Same purpose as random_bits, but only 
+// needs 32-bit multiplications, which SSE2 and NEON have for vectors of integers.
+inline uint32_t random_bits32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Replacements of sqrt, log, sin and cos for loops which should be vectorized. Math library 
+// calls block vectorization (they are scalar and sqrt may set errno), these are plain arithmetic.
+// Relative error is within a few float ulps.
+
+inline float batch_sqrt(float x) {
+  // Negative numbers are replaced with 0 by clearing all bits of the ones which have the sign bit
+  int32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  bits &= ~(bits >> 31);
+  memcpy(&x, &bits, sizeof(x));
+  // Reciprocal square root from the exponent bits refined by 3 Newton steps, 0 stays 0
+  bits = 0x5f3759df - (bits >> 1);
+  float y;
+  memcpy(&y, &bits, sizeof(y));
+  y = y * (1.5f - 0.5f * x * y * y);
+  y = y * (1.5f - 0.5f * x * y * y);
+  y = y * (1.5f - 0.5f * x * y * y);
+  return x * y;
+}
+
+// Natural logarithm of a positive normal number
+inline float batch_log(const float x) {
+  // x = m * 2^e where m is in [sqrt(1/2), sqrt(2)), 0x3f3504f3 are the bits of sqrt(1/2)
+  int32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const int32_t e = (bits - 0x3f3504f3) >> 23;
+  bits -= e * (1 << 23);
+  float m;
+  memcpy(&m, &bits, sizeof(m));
+  // log(m) = 2 atanh(s) where s = (m - 1) / (m + 1) is within +-0.172
+  const float s = (m - 1) / (m + 1);
+  const float s2 = s * s;
+  return e * 0.693147181f + 2 * s * (1 + s2 * (1.f / 3 + s2 * (1.f / 5 + s2 * (1.f / 7 + s2 * (1.f / 9)))));
+}
+
+// Sine and cosine of an angle in turns (1 is a full turn)
+inline void batch_sincos(const float turns, float& sine, float& cosine) {
+  // The nearest multiple of 90 degrees and the remaining angle within +-45 degrees
+  const float quarters = turns * 4;
+  const int32_t quadrant = (int32_t) (quarters + (quarters < 0 ? -0.5f : 0.5f));
+  const float x = (quarters - quadrant) * (glm::pi<float>() / 2);
+  const float x2 = x * x;
+  const float s = x * (1 + x2 * (-1.f / 6 + x2 * (1.f / 120 + x2 * (-1.f / 5040 + x2 * (1.f / 362880)))));
+  const float c = 1 + x2 * (-1.f / 2 + x2 * (1.f / 24 + x2 * (-1.f / 720 + x2 * (1.f / 40320))));
+  const float rotated_sine = (quadrant & 1) ? c : s;
+  const float rotated_cosine = (quadrant & 1) ? s : c;
+  sine = (quadrant & 2) ? -rotated_sine : rotated_sine;
+  cosine = ((quadrant + 1) & 2) ? -rotated_cosine : rotated_cosine;
+}
+
+// Propagates manufacturing tolerances of the engine dimensions to the stroke, the position
+// of the piston at TDC and the clearance between the piston and the cylinder head.
+// Every dimension is normally distributed around the nominal geometry and the tolerance
+// is treated as 3 standard deviations. The nominal cylinder points along the Y axis.
+//
+// Samples are processed in fixed-size chunks which are handed out to threads. Random numbers
+// of a sample depend only on the seed and the index of the sample, and statistics of the chunks 
+// are merged in the order of the chunks, so the result is the same for any thread count.
+struct tolerance_analysis {
+  geometry nominal;
+  // Distance from the piston to the cylinder head at TDC of the nominal geometry
+  float clearance = 1;
+
+  float crank_radius_tolerance = 0.05f;
+  float connecting_rod_length_tolerance = 0.1f;
+  float offset_tolerance = 0.1f;
+  float cylinder_angle_tolerance = radians(0.05f);
+
+  uint64_t samples = 1000000;
+  uint64_t seed = 1;
+  int threads = 0;
+
+  static constexpr int CHUNK_SIZE = 65536;
+  static constexpr int BATCH_SIZE = 1024;
+
+  enum output { STROKE, TOP_DEAD_CENTER, CLEARANCE, OUTPUT_COUNT };
+
+  struct result {
+    statistics moments[OUTPUT_COUNT];
+    histogram histograms[OUTPUT_COUNT];
+    uint64_t invalid = 0;
+  };
+
+  // Box-Muller transform of two uniform numbers given as 24-bit integers, returns two normal numbers
+  static void box_muller(const int32_t a, const int32_t b, float& first, float& second) {
+    const float u1 = 1 - a * (1.f / 16777216.f);
+    const float u2 = b * (1.f / 16777216.f);
+    const float radius = batch_sqrt(-2 * batch_log(u1));
+    float sine, cosine;
+    batch_sincos(u2, sine, cosine);
+    first = radius * cosine;
+    second = radius * sine;
+  }
+
+  // Evaluates the batch of BATCH_SIZE samples starting with the given sample index, which is a multiple 
+  // of BATCH_SIZE. Inputs are generated first and then the closed-form dead center equations are evaluated.
+  // Both loops have a constant trip count, only use the batch_ functions and write local arrays,
+  // so GCC vectorizes them at -O2 and -O3 (-fopt-info-vec-optimized).
+  void evaluate(const uint64_t first, float (&outputs)[OUTPUT_COUNT][BATCH_SIZE], uint8_t (&valid)[BATCH_SIZE]) const {
+    float r[BATCH_SIZE], rcr[BATCH_SIZE], e[BATCH_SIZE], theta[BATCH_SIZE];
+    // Random numbers of a sample depend on the seed, the index of its batch and its index in the batch
+    const uint32_t key = (uint32_t) random_bits(seed, first / BATCH_SIZE);
+    const float r_sigma = crank_radius_tolerance / 3;
+    const float rcr_sigma = connecting_rod_length_tolerance / 3;
+    const float e_sigma = offset_tolerance / 3;
+    const float theta_sigma = cylinder_angle_tolerance / 3;
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      const uint32_t counter = key + (uint32_t) i * 4;
+      float n0, n1, n2, n3;
+      box_muller(random_bits32(counter) >> 8, random_bits32(counter + 1) >> 8, n0, n1);
+      box_muller(random_bits32(counter + 2) >> 8, random_bits32(counter + 3) >> 8, n2, n3);
+      r[i] = nominal.crank_radius + n0 * r_sigma;
+      rcr[i] = nominal.connecting_rod_length + n1 * rcr_sigma;
+      e[i] = nominal.offset + n2 * e_sigma;
+      theta[i] = n3 * theta_sigma;
+    }
+
+    const float deck = nominal.top_dead_center() + clearance;
+    // Written to a local array, because uint8_t may alias the outputs
+    uint8_t reaches[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      // The cylinder is rotated around its origin, which changes the offset from the crankshaft 
+      // center and moves the projection of the crankshaft center along the cylinder axis.
+      float s, c;
+      batch_sincos(theta[i] * (1 / (2 * glm::pi<float>())), s, c);
+      const float offset = c * e[i];
+      const float tdc_squared = square(rcr[i] + r[i]) - square(offset);
+      const float bdc_squared = square(rcr[i] - r[i]) - square(offset);
+      reaches[i] = rcr[i] - r[i] > fabsf(offset);
+
+      const float tdc = batch_sqrt(tdc_squared);
+      const float tdc_position = c * (e[i] * s + tdc);
+      outputs[STROKE][i] = tdc - batch_sqrt(bdc_squared);
+      outputs[TOP_DEAD_CENTER][i] = tdc_position;
+      outputs[CLEARANCE][i] = deck - tdc_position;
+    }
+    memcpy(valid, reaches, sizeof(reaches));
+  }
+
+  result run() const {
+    // Histogram ranges come from a pilot chunk, so they are the same for any thread count
+    result pilot;
+    for (uint64_t first = 0; first < CHUNK_SIZE; first += BATCH_SIZE) {
+      float outputs[OUTPUT_COUNT][BATCH_SIZE];
+      uint8_t valid[BATCH_SIZE];
+      evaluate(first, outputs, valid);
+      for (int o = 0; o < OUTPUT_COUNT; o++) pilot.moments[o].add(outputs[o], valid, BATCH_SIZE);
+    }
+
+    const uint64_t chunk_count = (samples + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<result> chunks(chunk_count);
+    for (result& chunk : chunks) {
+      for (int o = 0; o < OUTPUT_COUNT; o++) {
+        const float sigma = std::max(float(sqrt(pilot.moments[o].variance())), EPSILON);
+        chunk.histograms[o].lower = pilot.moments[o].mean - 8 * sigma;
+        chunk.histograms[o].upper = pilot.moments[o].mean + 8 * sigma;
+      }
+    }
+
+    std::atomic<uint64_t> next_chunk(0);
+    const auto worker = [&]() {
+      float outputs[OUTPUT_COUNT][BATCH_SIZE];
+      uint8_t valid[BATCH_SIZE];
+      for (uint64_t c = next_chunk++; c < chunk_count; c = next_chunk++) {
+        result& chunk = chunks[c];
+        const uint64_t end = std::min(samples, (c + 1) * CHUNK_SIZE);
+        for (uint64_t first = c * CHUNK_SIZE; first < end; first += BATCH_SIZE) {
+          const int size = (int) std::min<uint64_t>(BATCH_SIZE, end - first);
+          evaluate(first, outputs, valid);
+          for (int i = 0; i < size; i++) chunk.invalid += !valid[i];
+          for (int o = 0; o < OUTPUT_COUNT; o++) {
+            chunk.moments[o].add(outputs[o], valid, size);
+            chunk.histograms[o].add(outputs[o], valid, size);
+          }
+        }
+      }
+    };
+    const int thread_count = threads > 0 ? threads : std::max(1, (int) std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_count; t++) workers.emplace_back(worker);
+    for (std::thread& thread : workers) thread.join();
+
+    result total = chunks[0];
+    for (uint64_t c = 1; c < chunk_count; c++) {
+      total.invalid += chunks[c].invalid;
+      for (int o = 0; o < OUTPUT_COUNT; o++) {
+        total.moments[o].merge(chunks[c].moments[o]);
+        total.histograms[o].merge(chunks[c].histograms[o]);
+      }
+    }
+    return total;
+  }
+};
+
+// ================= VALIDITY CERTIFICATION ===============
+
+// Closed interval of real numbers. Result of every operation contains all values the
+// operation can produce for any numbers from the argument intervals. Bounds are kept 
+// in double precision and results are widened by a few ulps at the end of the evaluation
+// instead of switching rounding modes.
+struct interval {
+  double lower = 0;
+  double upper = 0;
+
+  interval() = default;
+  interval(const double value): lower(value), upper(value) {}
+  interval(const double lower, const double upper): lower(lower), upper(upper) {}
+
+  double width() const { return upper - lower; }
+  double middle() const { return (lower + upper) / 2; }
+
+  friend interval operator+(const interval& a, const interval& b) { return {a.lower + b.lower, a.upper + b.upper}; }
+  friend interval operator-(const interval& a, const interval& b) { return {a.lower - b.upper, a.upper - b.lower}; }
+  friend interval operator*(const interval& a, const interval& b) {
+    const double p[4] = { a.lower * b.lower, a.lower * b.upper, a.upper * b.lower, a.upper * b.upper };
+    return { std::min(std::min(p[0], p[1]), std::min(p[2], p[3])), std::max(std::max(p[0], p[1]), std::max(p[2], p[3])) };
+  }
+  // Tighter than a * a, because both factors are the same number
+  friend interval square(const interval& a) {
+    const double l = a.lower * a.lower, u = a.upper * a.upper;
+    if (a.lower <= 0 && a.upper >= 0) return {0, std::max(l, u)};
+    return {std::min(l, u), std::max(l, u)};
+  }
+  friend interval sin(const interval& a) {
+    const double pi = glm::pi<double>();
+    if (a.width() >= 2 * pi) return {-1, 1};
+    double lower = std::min(std::sin(a.lower), std::sin(a.upper));
+    double upper = std::max(std::sin(a.lower), std::sin(a.upper));
+    // Maximum at pi/2 + 2 pi k and minimum at -pi/2 + 2 pi k
+    if (std::ceil((a.lower - pi / 2) / (2 * pi)) <= std::floor((a.upper - pi / 2) / (2 * pi))) upper = 1;
+    if (std::ceil((a.lower + pi / 2) / (2 * pi)) <= std::floor((a.upper + pi / 2) / (2 * pi))) lower = -1;
+    return {lower, upper};
+  }
+};
+
+// Certifies whole boxes of engine dimensions: either the connecting rod reaches the cylinder for every
+// combination of dimensions inside of the box, or it doesn't reach it for any of them. Cylinder direction
+// is fixed. Boxes which can't be certified are split in half along the widest dimension (relative to 
+// the initial box) until they get small enough, so the point-by-point solver is only needed near the 
+// boundary between valid and invalid dimensions.
+struct validity_certifier {
+  enum dimension { CRANK_RADIUS, CONNECTING_ROD_LENGTH, ORIGIN_X, ORIGIN_Y, ANGLE, DIMENSION_COUNT };
+  enum class validity { VALID, INVALID, UNDECIDED };
+
+  struct box { interval dimensions[DIMENSION_COUNT]; };
+
+  vec2 direction = vec2(0, 1);
+  int max_depth = 24;
+
+  // Discriminant of the quadratic equation in slider_crank. With a normalized direction it is
+  // equal to 4 * (rcr^2 - h^2), where h is the distance from the crankpin to the cylinder axis:
+  //   h = r * sin(alpha - beta) - (dx * ly - dy * lx), beta is the angle of the cylinder direction.
+  // Here every dimension appears only once, so the interval result is the exact range.
+  interval discriminant(const box& box) const {
+    const vec2 d = normalize(direction);
+    const double beta = atan2(d.y, d.x);
+    const interval* x = box.dimensions;
+    const interval h = x[CRANK_RADIUS] * sin(x[ANGLE] - interval(beta)) - (interval(d.x) * x[ORIGIN_Y] - interval(d.y) * x[ORIGIN_X]);
+    const interval result = interval(4) * (square(x[CONNECTING_ROD_LENGTH]) - square(h));
+    const double margin = 1e-12 * std::max(std::abs(result.lower), std::abs(result.upper));
+    return {result.lower - margin, result.upper + margin};
+  }
+
+  validity classify(const box& box) const {
+    const interval d = discriminant(box);
+    if (d.lower >= 0) return validity::VALID;
+    if (d.upper < 0) return validity::INVALID;
+    return validity::UNDECIDED;
+  }
+
+  // Calls callback(box, validity) for every certified box and for every undecided box
+  // of the maximum depth. Returns the number of evaluated boxes.
+  template <typename F>
+  uint64_t sweep(const box& root, F&& callback) const {
+    struct item { box region; int depth; };
+    std::vector<item> stack = { item{root, 0} };
+    uint64_t evaluated = 0;
+    while (!stack.empty()) {
+      const item current = stack.back();
+      stack.pop_back();
+      evaluated++;
+
+      const validity v = classify(current.region);
+      if (v != validity::UNDECIDED || current.depth == max_depth) {
+        callback(current.region, v);
+        continue;
+      }
+
+      int widest = 0;
+      double widest_width = 0;
+      for (int i = 0; i < DIMENSION_COUNT; i++) {
+        const double width = root.dimensions[i].width() > 0 
+          ? current.region.dimensions[i].width() / root.dimensions[i].width() : 0;
+        if (width > widest_width) { widest = i; widest_width = width; }
+      }
+      item left = item{current.region, current.depth + 1};
+      item right = item{current.region, current.depth + 1};
+      const double middle = current.region.dimensions[widest].middle();
+      left.region.dimensions[widest].upper = middle;
+      right.region.dimensions[widest].lower = middle;
+      stack.push_back(left);
+      stack.push_back(right);
+    }
+    return evaluated;
+  }
+};
+
+// ================= ADAPTIVE TRACE SAMPLING ==============
+
+// Samples the engine motion over a range of crankshaft angles with as few samples as possible.
+// An interval between two samples is split in half until the linear interpolation between them 
+// deviates from the real piston position (and optionally velocity) at the middle by less than 
+// the tolerance. Velocity is the derivative of the piston position with respect to the crank
+// angle (millimeters per radian), it comes from engine::sensitivities.
+struct adaptive_sampler {
+  struct sample {
+    float angle = 0;
+    vec2 crankpin_position = vec2(0, 0);
+    vec2 piston_position = vec2(0, 0);
+    vec2 piston_velocity = vec2(0, 0);
+    bool exists = false;
+  };
+
+  float position_tolerance = 0.01f;
+  // Velocity is not checked (and piston_velocity is not set) if the tolerance is zero
+  float velocity_tolerance = 0;
+  // Intervals are never split below this width (radians)
+  float min_step = 1e-5f;
+  // Initial uniform intervals, so no feature of the motion falls between two samples
+  int initial_intervals = 8;
+
+  // Smallest accepted interval, the uniform step which satisfies the same tolerance
+  float smallest_step = INFINITY;
+
+  // Velocity is only calculated when it is checked, sensitivities() costs several times more than the position
+  sample evaluate(engine& engine, const float angle) const {
+    engine.crankshaft.angle = angle;
+    engine.calculate_positions();
+
+    sample result;
+    result.angle = angle;
+    result.crankpin_position = engine.crankshaft.crankpin_position;
+    result.exists = engine.piston.exists;
+    if (result.exists) {
+      result.piston_position = engine.piston.position;
+      if (velocity_tolerance > 0) result.piston_velocity = engine.sensitivities().derivatives[engine::ANGLE];
+    }
+    return result;
+  }
+
+  // Returns samples in [from, to] sorted by angle. Doesn't change the state of the engine.
+  std::vector<sample> run(const ::engine& source, const float from, const float to) {
+    engine engine = source;
+    std::vector<sample> samples;
+    smallest_step = INFINITY;
+    sample start = evaluate(engine, from);
+    for (int i = 1; i <= initial_intervals; i++) {
+      const sample end = evaluate(engine, mix(from, to, float(i) / initial_intervals));
+      refine(engine, start, end, samples);
+      start = end;
     }
+    samples.push_back(start);
+    return samples;
+  }
 
-    const float t = (-b + sqrt(discriminant)) / divisor;
-    piston.position = cylinder.origin + cylinder_direction * t;
-    piston.exists = true;
+  // Appends the start sample and all samples inside of the interval. Intervals are split depth first
+  // with a stack of their ends, so the samples stay sorted and deep splits don't overflow the call stack.
+  void refine(engine& engine, sample start, const sample& end, std::vector<sample>& samples) {
+    std::vector<sample> ends = {end};
+    while (!ends.empty()) {
+      const sample next = ends.back();
+      const float width = next.angle - start.angle;
+      const float half = start.angle + width / 2;
+      // At large angles the spacing of floats exceeds min_step and the middle rounds to one of the ends
+      bool accurate = width / 2 < min_step || half <= start.angle || half >= next.angle;
+      sample middle;
+      if (!accurate) {
+        middle = evaluate(engine, half);
+        accurate = start.exists == middle.exists && middle.exists == next.exists;
+        if (accurate && middle.exists) {
+          const vec2 position = mix(start.piston_position, next.piston_position, 0.5f);
+          const vec2 velocity = mix(start.piston_velocity, next.piston_velocity, 0.5f);
+          accurate = length(position - middle.piston_position) <= position_tolerance
+            && (velocity_tolerance <= 0 || length(velocity - middle.piston_velocity) <= velocity_tolerance);
+        }
+      }
+
+      if (accurate) {
+        smallest_step = min(smallest_step, width);
+        samples.push_back(start);
+        start = next;
+        ends.pop_back();
+      } else {
+        ends.push_back(middle);
+      }
+    }
   }
 };
 
-// ================== RENDER STRUCTURES ===================
+// ================== CLEARANCE ANALYSIS ==================
+
+// Segment with a radius. Bearings are capsules of zero length and walls are capsules without radius.
+struct capsule {
+  vec2 a = vec2(0, 0);
+  vec2 b = vec2(0, 0);
+  float radius = 0;
+};
+
+// Rectangle of the given half size along the axis and across it
+struct oriented_box {
+  vec2 center = vec2(0, 0);
+  vec2 axis = vec2(1, 0);
+  vec2 half_size = vec2(0, 0);
+};
+
+// Z component of the cross product, the signed area of the parallelogram
+inline float cross(const vec2& a, const vec2& b) {
+  return a.x * b.y - a.y * b.x;
+}
+
+// std::min and std::max of values, the references they return make GCC select between addresses 
+// of temporaries and loops with them aren't vectorized
+inline float minimum(const float a, const float b) { return a < b ? a : b; }
+inline float maximum(const float a, const float b) { return a > b ? a : b; }
+
+// Squared distance from the point to the segment which starts at a and goes along d
+inline float segment_distance_squared(const vec2& point, const vec2& a, const vec2& d) {
+  // Clamped to [0, 1] without comparisons, GCC turns nested ones into branches which block vectorization
+  const float u = dot(point - a, d) / maximum(dot(d, d), 1e-30f);
+  const float t = 0.5f * (fabsf(u) - fabsf(u - 1) + 1);
+  const vec2 v = point - a - d * t;
+  return dot(v, v);
+}
+
+// Minimum clearance between the parts over a full revolution of the crankshaft.
+// Parts are made of capsules and boxes using the part sizes of the engine:
+//   crank  - web from the center to the crankpin, the main bearing and the crankpin bearing
+//   rod    - connecting rod body with both bearings
+//   piston - box from the piston pin along the cylinder
+//   walls  - both walls of the cylinder (bore is the piston width) along the travel of the top of the piston,
+//            the part which seals the cylinder. The rest of the piston leaves the cylinder near BDC,
+//            where the crank and the connecting rod swing wider than the bore.
+// Parts connected with a joint are not checked against each other, as well as the piston against the walls.
+// Negative clearance is the depth of the interference: the shortest move which separates the parts.
+//
+// Positions of the joints for all angles are solved in a single batch and stored as a structure of arrays.
+// Every shape is a capsule between 2 of these arrays, so distances of a pair of parts are calculated 
+// for a batch of angles with a loop per shape, which is vectorized.
+struct clearance_analysis {
+  enum pair { CRANK_PISTON, CRANK_WALLS, ROD_WALLS, PAIR_COUNT };
+  static constexpr const char* PAIR_NAMES[PAIR_COUNT] = { "crank - piston", "crank - walls", "rod - walls" };
+  static constexpr int BATCH_SIZE = 256;
+
+  geometry design;
+  engine::part_sizes parts;
+  int steps = 3600;
+
+  struct result {
+    float clearance[PAIR_COUNT] = {};
+    float angle[PAIR_COUNT] = {};
+  };
+
+  // Capsule between 2 joints for all angles, the arrays have the x and y coordinates of the joints
+  struct shape {
+    const float* ax;
+    const float* ay;
+    const float* bx;
+    const float* by;
+    float radius;
+  };
+
+  engine make_engine() const {
+    engine engine;
+    engine.parts = parts;
+    design.apply(engine);
+    return engine;
+  }
+
+  // Lowers the distances of the batch of angles which starts with the given index to the signed distances 
+  // between the shape and a part which doesn't move. Segments which don't cross are as close as an endpoint 
+  // of one of them to the other one. Crossing segments are separated by moving one of them along the normal
+  // of the other until its closer endpoint reaches the line of the other, the shortest of these moves 
+  // is the depth. Both loops have a constant trip count, no branches and the first one writes a local array,
+  // so GCC vectorizes them at -O2 and -O3 (-fopt-info-vec-optimized).
+  static void lower(float (&distances)[BATCH_SIZE], const int first, const shape& s, const capsule& fixed) {
+    const vec2 p2 = fixed.a;
+    const vec2 d2 = fixed.b - fixed.a;
+    const float inverse_length2 = 1 / batch_sqrt(dot(d2, d2) + 1e-30f);
+    const float radius = s.radius + fixed.radius;
+    float batch[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      const int k = first + i;
+      const vec2 p1 = vec2(s.ax[k], s.ay[k]);
+      const vec2 q1 = vec2(s.bx[k], s.by[k]);
+      const vec2 d1 = q1 - p1;
+      const float closest = minimum(
+        minimum(segment_distance_squared(p1, p2, d2), segment_distance_squared(q1, p2, d2)),
+        minimum(segment_distance_squared(p2, p1, d1), segment_distance_squared(p2 + d2, p1, d1)));
+      // Distances of the endpoints from the line of the other segment multiplied by the length of that segment
+      const float c1 = cross(d2, p1 - p2), c2 = cross(d2, q1 - p2);
+      const float c3 = cross(d1, p2 - p1), c4 = cross(d1, p2 + d2 - p1);
+      const bool crossing = (c1 * c2 < 0) & (c3 * c4 < 0);
+      const float depth = minimum(minimum(fabsf(c1), fabsf(c2)) * inverse_length2,
+        minimum(fabsf(c3), fabsf(c4)) / batch_sqrt(dot(d1, d1) + 1e-30f));
+      // Negative depth is smaller than any distance. A plain select would move the square root into 
+      // one of the branches, which isn't vectorized, because floating point operations may trap there.
+      batch[i] = minimum(batch_sqrt(closest), crossing ? -depth : INFINITY) - radius;
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) distances[i] = minimum(distances[i], batch[i]);
+  }
+
+  // Same for the piston, the center of the box is relative to the piston pin. In the coordinates of the box
+  // separated shapes are as close as an endpoint of the segment to the box or a corner of the box to the segment.
+  // Overlapping shapes are separated along one of the axes of the box or the normal of the segment by 
+  // the smallest overlap of their projections (separating axis theorem).
+  static void lower(float (&distances)[BATCH_SIZE], const int first, const shape& s, 
+    const float* pin_x, const float* pin_y, const oriented_box& piston) {
+    const vec2 normal = vec2(-piston.axis.y, piston.axis.x);
+    const vec2 h = piston.half_size;
+    float batch[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      const int k = first + i;
+      const vec2 center = vec2(pin_x[k], pin_y[k]) + piston.center;
+      const vec2 ca = vec2(s.ax[k], s.ay[k]) - center;
+      const vec2 cb = vec2(s.bx[k], s.by[k]) - center;
+      const vec2 a = vec2(dot(ca, piston.axis), dot(ca, normal));
+      const vec2 b = vec2(dot(cb, piston.axis), dot(cb, normal));
+      const vec2 d = b - a;
+
+      // Parts of the endpoints outside of the box, (x + |x|) / 2 is max(x, 0) without a comparison
+      const vec2 excess_a = vec2(fabsf(a.x), fabsf(a.y)) - h;
+      const vec2 excess_b = vec2(fabsf(b.x), fabsf(b.y)) - h;
+      const vec2 outside_a = (excess_a + vec2(fabsf(excess_a.x), fabsf(excess_a.y))) * 0.5f;
+      const vec2 outside_b = (excess_b + vec2(fabsf(excess_b.x), fabsf(excess_b.y))) * 0.5f;
+      const float closest = minimum(
+        minimum(minimum(dot(outside_a, outside_a), dot(outside_b, outside_b)),
+          minimum(segment_distance_squared(vec2(h.x, h.y), a, d), segment_distance_squared(vec2(-h.x, h.y), a, d))),
+        minimum(segment_distance_squared(vec2(h.x, -h.y), a, d), segment_distance_squared(vec2(-h.x, -h.y), a, d)));
+
+      // A point is projected on the axis of the box instead of the normal
+      const float length_squared = dot(d, d);
+      const vec2 m = vec2(-d.y, d.x) / (batch_sqrt(length_squared) + 1e-30f) + vec2(length_squared > 1e-30f ? 0 : 1, 0);
+      // Projection of the segment on an axis of the box is |d| / 2 around the middle of the segment
+      const float overlap_x = h.x + fabsf(d.x) * 0.5f - fabsf(a.x + b.x) * 0.5f;
+      const float overlap_y = h.y + fabsf(d.y) * 0.5f - fabsf(a.y + b.y) * 0.5f;
+      const float overlap_m = h.x * fabsf(m.x) + h.y * fabsf(m.y) - fabsf(dot(a, m));
+      const float depth = minimum(minimum(overlap_x, overlap_y), overlap_m);
+      batch[i] = minimum(batch_sqrt(closest), depth > 0 ? -depth : INFINITY) - s.radius;
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) distances[i] = minimum(distances[i], batch[i]);
+  }
+
+  result run() const {
+    const engine engine = make_engine();
+    std::vector<float> angles(steps);
+    for (int i = 0; i < steps; i++) angles[i] = 2 * pi<float>() * i / steps;
+    std::vector<vec2> crankpins(steps), pins(steps);
+    std::vector<uint8_t> exists(steps);
+    engine.calculate_positions(steps, angles.data(), crankpins.data(), pins.data(), exists.data());
+
+    // Joints as a structure of arrays padded to whole batches. The crankshaft center is an array too, 
+    // so all shapes are made the same way.
+    const int size = (steps + BATCH_SIZE - 1) / BATCH_SIZE * BATCH_SIZE;
+    std::vector<float> center(size), crankpin_x(size), crankpin_y(size), pin_x(size), pin_y(size);
+    for (int i = 0; i < steps; i++) {
+      if (!exists[i]) continue;
+      crankpin_x[i] = crankpins[i].x;
+      crankpin_y[i] = crankpins[i].y;
+      pin_x[i] = pins[i].x;
+      pin_y[i] = pins[i].y;
+    }
+    const float* o = center.data();
+    const float* cx = crankpin_x.data();
+    const float* cy = crankpin_y.data();
+    const float* px = pin_x.data();
+    const float* py = pin_y.data();
+    const shape crank[3] = {
+      shape{o, o, cx, cy, parts.crank_web_width / 2},
+      shape{o, o, o, o, parts.bearing_radius},
+      shape{cx, cy, cx, cy, parts.bearing_radius}
+    };
+    const shape rod[3] = {
+      shape{cx, cy, px, py, parts.connecting_rod_width / 2},
+      shape{cx, cy, cx, cy, parts.bearing_radius},
+      shape{px, py, px, py, parts.bearing_radius}
+    };
+
+    // Walls cover the travel of the top of the piston
+    const vec2 axis = normalize(engine.cylinder.direction);
+    const vec2 normal = vec2(-axis.y, axis.x);
+    float lowest = INFINITY, highest = -INFINITY;
+    for (int i = 0; i < steps; i++) {
+      if (!exists[i]) continue;
+      const float position = dot(pins[i] - engine.cylinder.origin, axis);
+      lowest = std::min(lowest, position);
+      highest = std::max(highest, position);
+    }
+    const vec2 bottom = engine.cylinder.origin + axis * (lowest + parts.piston_length);
+    const vec2 top = engine.cylinder.origin + axis * (highest + parts.piston_length);
+    const float bore = parts.piston_width / 2;
+    const capsule walls[2] = {
+      capsule{bottom + normal * bore, top + normal * bore, 0},
+      capsule{bottom - normal * bore, top - normal * bore, 0}
+    };
+    const oriented_box piston = oriented_box{axis * (parts.piston_length / 2), axis, vec2(parts.piston_length, parts.piston_width) / 2.f};
+
+    result result;
+    for (int p = 0; p < PAIR_COUNT; p++) {
+      float clearance = INFINITY;
+      int angle = 0;
+      for (int first = 0; first < size; first += BATCH_SIZE) {
+        float distances[BATCH_SIZE];
+        std::fill(distances, distances + BATCH_SIZE, INFINITY);
+        for (int s = 0; s < 3; s++) {
+          if (p == CRANK_PISTON) lower(distances, first, crank[s], px, py, piston);
+          for (int w = 0; w < 2; w++) {
+            if (p == CRANK_WALLS) lower(distances, first, crank[s], walls[w]);
+            if (p == ROD_WALLS) lower(distances, first, rod[s], walls[w]);
+          }
+        }
+        for (int i = 0; i < BATCH_SIZE && first + i < steps; i++) {
+          if (exists[first + i] && distances[i] < clearance) {
+            clearance = distances[i];
+            angle = first + i;
+          }
+        }
+      }
+      result.clearance[p] = clearance;
+      result.angle[p] = angles[angle];
+    }
+    return result;
+  }
+};
+
+// ====================== VALVE TRAIN =====================
+
+// Lift of a cam lobe as a function of the cam angle. Lobes are described in crank degrees of 
+// the 720 degree cycle (the cam turns at half the crank speed), measured from the TDC at the start of the intake stroke.
+// A lobe is either a 3-4-5 polynomial (smooth lift, velocity and acceleration) or a table of points 
+// which are interpolated linearly. Lift is 0 outside of the lobe.
+struct cam_lobe {
+  // Crank angle of the maximum lift and the duration of the lobe (crank degrees)
+  float center = 110;
+  float duration = 240;
+  float max_lift = 10;
+  // (crank degrees, lift), sorted by angle and spanning at most one cycle. 
+  // Used instead of the polynomial if not empty
+  std::vector<vec2> table;
+
+  float lift(const float crank_degrees) const {
+    if (!table.empty()) {
+      // Same cycle as the table, so tables may cross 0 or 720 degrees
+      const float angle = crank_degrees - 720 * floor((crank_degrees - table.front().x) / 720);
+      if (angle <= table.front().x || angle >= table.back().x) return 0;
+      const auto next = std::upper_bound(table.begin(), table.end(), angle, 
+        [](const float angle, const vec2& point) { return angle < point.x; });
+      const vec2& a = *(next - 1);
+      const vec2& b = *next;
+      return mix(a.y, b.y, (angle - a.x) / (b.x - a.x));
+    }
+    // Distance from the center along the cycle
+    const float distance = abs(crank_degrees - center - 720 * round((crank_degrees - center) / 720));
+    const float u = 1 - distance / (duration / 2);
+    if (u <= 0) return 0;
+    return max_lift * u * u * u * (10 - 15 * u + 6 * u * u);
+  }
+};
+
+// Cam lobe compiled into a table over the whole cycle with the lift and its derivative with respect 
+// to the crank angle. Evaluation is a linear interpolation without any branches, so batches of angles are vectorized
+// (GCC -fopt-info-vec-optimized at -O2 and -O3). Table lookups are gathers, without AVX2 they are emulated 
+// with scalar loads, but the index, the fraction and the interpolation are done with vectors.
+struct compiled_cam {
+  // Power of two, 0.35 crank degrees per entry
+  static constexpr int SIZE = 2048;
+  static constexpr int BATCH_SIZE = 256;
+  // One more entry to interpolate the last interval without wrapping around
+  float lifts[SIZE + 1] = {};
+  float velocities[SIZE + 1] = {};
+
+  void compile(const cam_lobe& lobe) {
+    const float step = 720.f / SIZE;
+    for (int i = 0; i <= SIZE; i++) lifts[i] = lobe.lift(i * step);
+    // Central differences, per crank radian
+    for (int i = 0; i <= SIZE; i++) {
+      const float next = lobe.lift((i + 0.5f) * step);
+      const float previous = lobe.lift((i - 0.5f) * step);
+      velocities[i] = (next - previous) / radians(step);
+    }
+  }
+
+  // Crank angles are in radians from the TDC of the intake stroke, any number of turns.
+  // Angles are processed in batches of BATCH_SIZE copied to local arrays, so both loops have a constant trip count
+  // and don't need alias checks. The table index is the floor of the position, wrapped with a mask: 
+  // floor() is a library call without SSE4.1, truncation corrected for negative positions isn't.
+  void evaluate(const int count, const float* crank_angles, float* lift, float* velocity) const {
+    const float scale = SIZE / (4 * pi<float>());
+    for (int first = 0; first < count; first += BATCH_SIZE) {
+      const int size = std::min(BATCH_SIZE, count - first);
+      float x[BATCH_SIZE] = {};
+      memcpy(x, crank_angles + first, size * sizeof(float));
+      int32_t index[BATCH_SIZE];
+      float fraction[BATCH_SIZE];
+      for (int i = 0; i < BATCH_SIZE; i++) {
+        const float position = x[i] * scale;
+        int32_t whole = (int32_t) position;
+        whole -= position < (float) whole;
+        fraction[i] = position - (float) whole;
+        index[i] = whole & (SIZE - 1);
+      }
+      float lift_batch[BATCH_SIZE], velocity_batch[BATCH_SIZE];
+      for (int i = 0; i < BATCH_SIZE; i++) {
+        const int32_t j = index[i];
+        lift_batch[i] = lifts[j] + (lifts[j + 1] - lifts[j]) * fraction[i];
+        velocity_batch[i] = velocities[j] + (velocities[j + 1] - velocities[j]) * fraction[i];
+      }
+      memcpy(lift + first, lift_batch, size * sizeof(float));
+      memcpy(velocity + first, velocity_batch, size * sizeof(float));
+    }
+  }
+};
+
+// Intake and exhaust valve of the cylinder. Valves move along the cylinder axis from the cylinder head, 
+// which is the deck clearance above the top of the piston at TDC.
+// Every valve is checked for clearance with the top of the piston over the whole 720 degree cycle.
+struct valve_train {
+  enum valve { INTAKE, EXHAUST, VALVE_COUNT };
+  static constexpr const char* VALVE_NAMES[VALVE_COUNT] = { "intake", "exhaust" };
+
+  geometry design;
+  engine::part_sizes parts;
+  cam_lobe lobes[VALVE_COUNT] = { cam_lobe{110, 240, 10, {}}, cam_lobe{-110, 240, 10, {}} };
+  float deck_clearance = 5;
+  int steps = 7200;
+
+  struct result {
+    float max_lift[VALVE_COUNT] = {};
+    float max_velocity[VALVE_COUNT] = {};
+    float clearance[VALVE_COUNT] = {};
+    // Crank degrees of the cycle
+    float clearance_angle[VALVE_COUNT] = {};
+  };
+
+  result run() const {
+    engine engine;
+    engine.parts = parts;
+    design.apply(engine);
+    const vec2 axis = normalize(engine.cylinder.direction);
+
+    // Cycle starts at TDC, where the crank and the connecting rod are collinear
+    const vec2 top = axis * design.top_dead_center() + vec2(axis.y, -axis.x) * design.offset;
+    const float tdc_angle = atan2(top.y, top.x);
+
+    std::vector<float> cycle(steps), angles(steps);
+    for (int i = 0; i < steps; i++) {
+      cycle[i] = 4 * pi<float>() * i / steps;
+      angles[i] = tdc_angle + cycle[i];
+    }
+    std::vector<vec2> crankpins(steps), pistons(steps);
+    std::vector<uint8_t> exists(steps);
+    engine.calculate_positions(steps, angles.data(), crankpins.data(), pistons.data(), exists.data());
+    // Positions are measured along the axis from the cylinder origin
+    float head = -INFINITY;
+    for (int i = 0; i < steps; i++) {
+      if (exists[i]) head = std::max(head, dot(pistons[i] - engine.cylinder.origin, axis) + parts.piston_length + deck_clearance);
+    }
+
+    result result;
+    std::vector<float> lift(steps), velocity(steps);
+    for (int v = 0; v < VALVE_COUNT; v++) {
+      compiled_cam cam;
+      cam.compile(lobes[v]);
+      cam.evaluate(steps, cycle.data(), lift.data(), velocity.data());
+
+      result.clearance[v] = INFINITY;
+      for (int i = 0; i < steps; i++) {
+        result.max_lift[v] = std::max(result.max_lift[v], lift[i]);
+        result.max_velocity[v] = std::max(result.max_velocity[v], abs(velocity[i]));
+        if (!exists[i]) continue;
+        const float piston_top = dot(pistons[i] - engine.cylinder.origin, axis) + parts.piston_length;
+        const float clearance = head - lift[i] - piston_top;
+        if (clearance < result.clearance[v]) {
+          result.clearance[v] = clearance;
+          result.clearance_angle[v] = degrees(cycle[i]);
+        }
+      }
+    }
+    return result;
+  }
+};
+
+// ==================== PLANAR LINKAGES ===================
+
+// Solver for planar mechanisms made of points connected by constraints:
+//   DISTANCE - two points are connected by a rigid link of the given length
+//   DRIVER   - a point rotates around another point with the given radius at the input angle of the mechanism
+//   SLIDER   - a point moves along a line
+// Fixed points belong to the ground, coordinates of other points are the unknowns.
+//
+// Constraints are solved with the Newton method. Every constraint only depends on 2 points, so each row
+// of the Jacobian has at most 4 non-zero values and is stored as such. The linear system of each iteration 
+// is solved with the conjugate gradient method applied to the least squares problem (CGLS), which only
+// needs products with the sparse Jacobian and its transpose and also works for redundant constraints.
+// Positions from the previous solution are the initial guess of the next one, so when the input angle 
+// changes by small steps Newton converges in one or two iterations and stays on the same assembly branch.
+struct linkage {
+  enum class constraint_type { DISTANCE, DRIVER, SLIDER };
+
+  struct constraint {
+    constraint_type type = constraint_type::DISTANCE;
+    int a = 0, b = 0;
+    // Length of the link or the radius of the driver
+    double length = 0;
+    // Line of the slider, the direction is normalized
+    double origin[2] = {};
+    double direction[2] = {};
+  };
+
+  // Sparse row of the Jacobian
+  struct row {
+    int count = 0;
+    int columns[4] = {};
+    double values[4] = {};
+  };
+
+  // Two coordinates per point
+  std::vector<double> positions;
+  std::vector<uint8_t> fixed;
+  // Index of the first unknown of every point, -1 for fixed points
+  std::vector<int> unknowns;
+  int unknown_count = 0;
+  std::vector<constraint> constraints;
+  // Input angle of the drivers
+  double angle = 0;
+
+  int max_iterations = 30;
+  double tolerance = 1e-9;
+
+  // Buffers reused by every solve
+  std::vector<double> residuals, step;
+  std::vector<row> rows;
+  std::vector<double> cg_r, cg_s, cg_p, cg_q;
+
+  int add_point(const vec2& position, const bool is_fixed = false) {
+    positions.push_back(position.x);
+    positions.push_back(position.y);
+    fixed.push_back(is_fixed);
+    unknowns.push_back(is_fixed ? -1 : unknown_count);
+    if (!is_fixed) unknown_count += 2;
+    return (int) fixed.size() - 1;
+  }
+
+  vec2 point(const int index) const { return vec2(positions[index * 2], positions[index * 2 + 1]); }
+
+  void add_distance(const int a, const int b, const double length) {
+    constraint c;
+    c.type = constraint_type::DISTANCE;
+    c.a = a;
+    c.b = b;
+    c.length = length;
+    constraints.push_back(c);
+  }
+
+  // Point a rotates around point b
+  void add_driver(const int a, const int b, const double radius) {
+    constraint c;
+    c.type = constraint_type::DRIVER;
+    c.a = a;
+    c.b = b;
+    c.length = radius;
+    constraints.push_back(c);
+  }
+
+  void add_slider(const int a, const vec2& origin, const vec2& direction) {
+    const vec2 d = normalize(direction);
+    constraint c;
+    c.type = constraint_type::SLIDER;
+    c.a = a;
+    c.origin[0] = origin.x;
+    c.origin[1] = origin.y;
+    c.direction[0] = d.x;
+    c.direction[1] = d.y;
+    constraints.push_back(c);
+  }
+
+  // Adds the derivative with respect to the coordinate of the point, if it is an unknown
+  void add_derivative(row& row, const int point, const int coordinate, const double value) const {
+    if (unknowns[point] < 0) return;
+    row.columns[row.count] = unknowns[point] + coordinate;
+    row.values[row.count] = value;
+    row.count++;
+  }
+
+  // Residuals of all constraints and the rows of the Jacobian
+  void evaluate(std::vector<double>& residuals, std::vector<row>& rows) const {
+    residuals.clear();
+    rows.clear();
+    for (const constraint& c: constraints) {
+      const double ax = positions[c.a * 2], ay = positions[c.a * 2 + 1];
+      const double bx = positions[c.b * 2], by = positions[c.b * 2 + 1];
+      switch (c.type) {
+        case constraint_type::DISTANCE: {
+          const double dx = ax - bx, dy = ay - by;
+          const double distance = std::max(sqrt(dx * dx + dy * dy), 1e-12);
+          row r;
+          add_derivative(r, c.a, 0, dx / distance);
+          add_derivative(r, c.a, 1, dy / distance);
+          add_derivative(r, c.b, 0, -dx / distance);
+          add_derivative(r, c.b, 1, -dy / distance);
+          residuals.push_back(distance - c.length);
+          rows.push_back(r);
+          break;
+        }
+        case constraint_type::DRIVER: {
+          const double target[2] = { bx + c.length * cos(angle), by + c.length * sin(angle) };
+          for (int coordinate = 0; coordinate < 2; coordinate++) {
+            row r;
+            add_derivative(r, c.a, coordinate, 1);
+            add_derivative(r, c.b, coordinate, -1);
+            residuals.push_back(positions[c.a * 2 + coordinate] - target[coordinate]);
+            rows.push_back(r);
+          }
+          break;
+        }
+        case constraint_type::SLIDER: {
+          // Distance from the line
+          row r;
+          add_derivative(r, c.a, 0, c.direction[1]);
+          add_derivative(r, c.a, 1, -c.direction[0]);
+          residuals.push_back((ax - c.origin[0]) * c.direction[1] - (ay - c.origin[1]) * c.direction[0]);
+          rows.push_back(r);
+          break;
+        }
+      }
+    }
+  }
+
+  // Solves J * step = -residuals in the least squares sense
+  void solve_step() {
+    const int n = unknown_count;
+    const int m = (int) rows.size();
+    step.assign(n, 0);
+    // r = -residuals - J * step, s = J^T * r, p = s, q = J * p
+    std::vector<double>& r = cg_r;
+    std::vector<double>& s = cg_s;
+    std::vector<double>& p = cg_p;
+    std::vector<double>& q = cg_q;
+    r.resize(m);
+    s.assign(n, 0);
+    q.resize(m);
+    for (int i = 0; i < m; i++) r[i] = -residuals[i];
+    for (int i = 0; i < m; i++) 
+      for (int k = 0; k < rows[i].count; k++) s[rows[i].columns[k]] += rows[i].values[k] * r[i];
+    p = s;
+    double gamma = 0;
+    for (const double v: s) gamma += v * v;
+
+    for (int iteration = 0; iteration < 2 * n && gamma > 1e-30; iteration++) {
+      double q_norm = 0;
+      for (int i = 0; i < m; i++) {
+        q[i] = 0;
+        for (int k = 0; k < rows[i].count; k++) q[i] += rows[i].values[k] * p[rows[i].columns[k]];
+        q_norm += q[i] * q[i];
+      }
+      if (q_norm <= 0) break;
+      const double alpha = gamma / q_norm;
+      for (int j = 0; j < n; j++) step[j] += alpha * p[j];
+      for (int i = 0; i < m; i++) r[i] -= alpha * q[i];
+      std::fill(s.begin(), s.end(), 0);
+      for (int i = 0; i < m; i++) 
+        for (int k = 0; k < rows[i].count; k++) s[rows[i].columns[k]] += rows[i].values[k] * r[i];
+      double next_gamma = 0;
+      for (const double v: s) next_gamma += v * v;
+      const double beta = next_gamma / gamma;
+      gamma = next_gamma;
+      for (int j = 0; j < n; j++) p[j] = s[j] + beta * p[j];
+    }
+  }
+
+  // Returns the number of Newton iterations or -1 if constraints can't be satisfied
+  int solve() {
+    for (int iteration = 0; iteration <= max_iterations; iteration++) {
+      evaluate(residuals, rows);
+      double error = 0;
+      for (const double r: residuals) error = std::max(error, abs(r));
+      if (error < tolerance) return iteration;
+      if (iteration == max_iterations) break;
+
+      solve_step();
+      for (size_t point = 0; point < fixed.size(); point++) {
+        if (unknowns[point] < 0) continue;
+        positions[point * 2] += step[unknowns[point]];
+        positions[point * 2 + 1] += step[unknowns[point] + 1];
+      }
+    }
+    return -1;
+  }
+};
+
+// ================= FIXED-POINT KINEMATICS ===============
+
+// Integer version of calculate_positions() for microcontrollers without a floating point unit.
+// It only uses 32-bit and 64-bit integer additions, multiplications and shifts, no division per angle.
+//   lengths        - Q16.16 (int32), range of +-32768 with the resolution of 1.5e-5
+//   unit values    - Q2.30 (int32) for sin, cos and the cylinder direction
+//   squared values - Q32.32 (int64)
+//   angles         - binary angle (uint32), 2^32 is a full turn
+// Sine and cosine are calculated with CORDIC and the square root digit by digit.
+//
+// Cylinder direction is normalized once in prepare(), so the quadratic coefficient "a" is 1 and the solution
+// is t = (-b + sqrt(b^2 - 4c)) / 2. The "is_zero(divisor)" case of the float path can only happen with a zero 
+// direction, which prepare() rejects.
+//
+// Error bound: for lengths up to 1000 the difference from the float path is under 0.001 for the crankpin and 
+// the piston ("piston fixed" checks it for 2^angle-bits angles, 32 is every angle). Q16.16 rounding contributes 
+// 1.5e-5 per operation and CORDIC 2^-28 relative. The rest comes from the float path itself:
+// float has 24 bits of mantissa, which is less than 32 bits of Q16.16 for values above 256.
+typedef int32_t q16;
+typedef int32_t q30;
+
+q16 to_q16(const float value) { return (q16) lround(value * 65536.0); }
+float from_q16(const q16 value) { return value / 65536.f; }
+
+// Square root of an unsigned 64-bit value, rounded down
+uint32_t integer_sqrt(uint64_t value) {
+  if (value == 0) return 0;
+  uint64_t result = 0;
+  // The highest even bit which is not above the value
+  uint64_t bit = 1ull << ((63 - __builtin_clzll(value)) & ~1);
+  while (bit != 0) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t) result;
+}
+
+// Sine and cosine (Q2.30) of a binary angle with 30 iterations of CORDIC
+void cordic_sincos(const uint32_t angle, q30& sine, q30& cosine) {
+  // atan(2^-i) as binary angles
+  static const int32_t ATAN[30] = {
+    536870912, 316933406, 167458907, 85004756, 42667331, 21354465, 10679838, 5340245, 2670163, 1335087, 
+    667544, 333772, 166886, 83443, 41722, 20861, 10430, 5215, 2608, 1304, 652, 326, 163, 81, 41, 20, 10, 5, 3, 1
+  };
+  // 1 / gain of CORDIC, so that the result has the length of 1
+  const int32_t K = 652032874;
+
+  // CORDIC converges for angles within +-90 degrees, other angles are rotated by 180 degrees
+  int32_t z = (int32_t) angle;
+  const bool flip = z > (1 << 30) || z < -(1 << 30);
+  if (flip) z = (int32_t) (angle + 0x80000000u);
+
+  int32_t x = K, y = 0;
+  for (int i = 0; i < 30; i++) {
+    // Rotation is in the direction of the remaining angle: (v ^ sign) - sign is v for z >= 0 and -v otherwise
+    const int32_t sign = z >> 31;
+    const int32_t dx = y >> i;
+    const int32_t dy = x >> i;
+    x -= (dx ^ sign) - sign;
+    y += (dy ^ sign) - sign;
+    z -= (ATAN[i] ^ sign) - sign;
+  }
+  cosine = flip ? -x : x;
+  sine = flip ? -y : y;
+}
+
+struct fixed_slider_crank {
+  q16 crank_radius = 0;
+  q16 origin_x = 0, origin_y = 0;
+  q30 direction_x = 0, direction_y = 0;
+  // Terms which don't depend on the angle: 2 * (l . d) in Q16.16 and |l|^2 - rcr^2 + r^2 in Q32.32
+  q16 b0 = 0;
+  int64_t c0 = 0;
+
+  // Returns false if the cylinder has no direction
+  bool prepare(const engine& engine) {
+    crank_radius = to_q16(engine.crankshaft.crank_radius);
+    const q16 rod = to_q16(engine.connecting_rod_length);
+    origin_x = to_q16(engine.cylinder.origin.x);
+    origin_y = to_q16(engine.cylinder.origin.y);
+    const int64_t x = to_q16(engine.cylinder.direction.x);
+    const int64_t y = to_q16(engine.cylinder.direction.y);
+    const int64_t length = integer_sqrt((uint64_t) (x * x + y * y));
+    if (length == 0) return false;
+    direction_x = (q30) ((x << 30) / length);
+    direction_y = (q30) ((y << 30) / length);
+
+    b0 = (q16) (2 * (((int64_t) origin_x * direction_x + (int64_t) origin_y * direction_y) >> 30));
+    c0 = (int64_t) origin_x * origin_x + (int64_t) origin_y * origin_y - (int64_t) rod * rod + (int64_t) crank_radius * crank_radius;
+    return true;
+  }
+
+  // Returns false if the connecting rod doesn't reach the cylinder
+  bool solve(const uint32_t angle, q16& crankpin_x, q16& crankpin_y, q16& piston_x, q16& piston_y) const {
+    q30 sine, cosine;
+    cordic_sincos(angle, sine, cosine);
+    const q16 rcos = (q16) (((int64_t) crank_radius * cosine) >> 30);
+    const q16 rsin = (q16) (((int64_t) crank_radius * sine) >> 30);
+    crankpin_x = rcos;
+    crankpin_y = rsin;
+
+    const int64_t b = b0 - 2 * (((int64_t) direction_x * rcos + (int64_t) direction_y * rsin) >> 30);
+    const int64_t c = c0 - 2 * (int64_t) origin_x * rcos - 2 * (int64_t) origin_y * rsin;
+    const int64_t discriminant = b * b - 4 * c;
+    if (discriminant < 0) return false;
+
+    const int64_t t = (-b + (int64_t) integer_sqrt((uint64_t) discriminant)) >> 1;
+    piston_x = origin_x + (q16) ((direction_x * t) >> 30);
+    piston_y = origin_y + (q16) ((direction_y * t) >> 30);
+    return true;
+  }
+};
+
+// ================= COMPILE-TIME PRESETS =================
+
+// Scalar for slider_crank which the compiler can evaluate in constant expressions.
+// cos, sin and sqrt from math.h are not constexpr, so they are replaced with the Taylor series
+// and Newton's method. Calculated in double, which is more accurate than the float path.
+struct constant_scalar {
+  static constexpr double PI = 3.14159265358979323846;
+  double value = 0;
+
+  constexpr constant_scalar() = default;
+  constexpr constant_scalar(const double value): value(value) {}
+
+  friend constexpr constant_scalar operator+(const constant_scalar& a, const constant_scalar& b) { return a.value + b.value; }
+  friend constexpr constant_scalar operator-(const constant_scalar& a, const constant_scalar& b) { return a.value - b.value; }
+  friend constexpr constant_scalar operator-(const constant_scalar& a) { return -a.value; }
+  friend constexpr constant_scalar operator*(const constant_scalar& a, const constant_scalar& b) { return a.value * b.value; }
+  friend constexpr constant_scalar operator/(const constant_scalar& a, const constant_scalar& b) { return a.value / b.value; }
+  friend constexpr bool operator<(const constant_scalar& a, const constant_scalar& b) { return a.value < b.value; }
+
+  static constexpr double sine(double x) {
+    // Reduces the angle to [-pi/2, pi/2] where the series converges in a few terms
+    x -= 2 * PI * (int64_t) (x / (2 * PI));
+    if (x > PI) x -= 2 * PI;
+    if (x < -PI) x += 2 * PI;
+    if (x > PI / 2) x = PI - x;
+    if (x < -PI / 2) x = -PI - x;
+    double term = x, sum = x;
+    for (int n = 1; term > 1e-17 || term < -1e-17; n++) {
+      term *= -x * x / ((2 * n) * (2 * n + 1));
+      sum += term;
+    }
+    return sum;
+  }
+
+  friend constexpr constant_scalar sin(const constant_scalar& a) { return sine(a.value); }
+  friend constexpr constant_scalar cos(const constant_scalar& a) { return sine(a.value + PI / 2); }
+  friend constexpr constant_scalar sqrt(const constant_scalar& a) {
+    if (!(a.value > 0)) return 0.0;
+    // Newton's method decreases the root until it stops changing when started above the result
+    double root = a.value > 1 ? a.value : 1;
+    while (true) {
+      const double next = (root + a.value / root) / 2;
+      if (next >= root) return root;
+      root = next;
+    }
+  }
+  friend constexpr constant_scalar square(const constant_scalar& a) { return a * a; }
+  friend constexpr bool is_zero(const constant_scalar& a) { return a.value < EPSILON && -a.value < EPSILON; }
+};
+
+struct preset_position {
+  float crankpin_x = 0, crankpin_y = 0;
+  float piston_x = 0, piston_y = 0;
+  bool exists = false;
+};
+
+// Engine dimensions for a fixed production geometry. Same parameters as the engine, 
+// but can be declared as constexpr and solved by the compiler.
+struct engine_preset {
+  const char* name = "";
+  float crank_radius = 50;
+  float connecting_rod_length = 100;
+  float origin_x = 0, origin_y = 0;
+  float direction_x = 0, direction_y = 20;
+
+  constexpr preset_position solve(const double angle) const {
+    slider_crank<constant_scalar> solver;
+    solver.crank_radius = crank_radius;
+    solver.connecting_rod_length = connecting_rod_length;
+    solver.origin_x = origin_x;
+    solver.origin_y = origin_y;
+    solver.direction_x = direction_x;
+    solver.direction_y = direction_y;
+    solver.angle = angle;
+    solver.solve();
+    return preset_position{
+      (float) solver.crankpin_x.value, (float) solver.crankpin_y.value, 
+      (float) solver.piston_x.value, (float) solver.piston_y.value, 
+      solver.exists
+    };
+  }
+
+  void apply(engine& engine) const {
+    engine.crankshaft.crank_radius = crank_radius;
+    engine.connecting_rod_length = connecting_rod_length;
+    engine.cylinder.origin = vec2(origin_x, origin_y);
+    engine.cylinder.direction = vec2(direction_x, direction_y);
+  }
+};
+
+// Positions of the crankpin and the piston for SIZE crank angles evenly spaced over a full turn.
+// When declared as constexpr the whole table is generated by the compiler.
+template <int SIZE>
+struct preset_table {
+  static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "Size of the table must be a power of two");
+  engine_preset preset;
+  std::array<preset_position, SIZE> positions;
+
+  static constexpr preset_table generate(const engine_preset& preset) {
+    preset_table table{preset, {}};
+    for (int i = 0; i < SIZE; i++) table.positions[i] = preset.solve(i * (2 * constant_scalar::PI / SIZE));
+    return table;
+  }
+
+  // Same as engine::calculate_positions() for an engine with the preset geometry, but only reads 
+  // two entries of the table and interpolates between them. Where the piston stops existing, 
+  // it doesn't exist if either of the two entries doesn't have it.
+  void calculate_positions(engine& engine) const {
+    PROFILE_SCOPE(CALCULATE_POSITIONS);
+    const float position = engine.crankshaft.angle * (SIZE / (2 * pi<float>()));
+    const float index = floor(position);
+    const float t = position - index;
+    const preset_position& a = positions[(int64_t) index & (SIZE - 1)];
+    const preset_position& b = positions[((int64_t) index + 1) & (SIZE - 1)];
+
+    engine.crankshaft.crankpin_position = vec2{
+      a.crankpin_x + (b.crankpin_x - a.crankpin_x) * t,
+      a.crankpin_y + (b.crankpin_y - a.crankpin_y) * t
+    };
+    engine.piston.exists = a.exists && b.exists;
+    if (engine.piston.exists) engine.piston.position = vec2{
+      a.piston_x + (b.piston_x - a.piston_x) * t,
+      a.piston_y + (b.piston_y - a.piston_y) * t
+    };
+  }
+};
+
+// With 1024 entries the linear interpolation is within 0.001 of the exact positions 
+// for the preset geometries below (checked by "piston presets").
+constexpr int PRESET_TABLE_SIZE = 1024;
+typedef preset_table<PRESET_TABLE_SIZE> preset_table_type;
+
+// Every table is a separate constant, compilers limit the number of steps per constant expression
+constexpr preset_table_type DEFAULT_PRESET = preset_table_type::generate(engine_preset{"default", 50, 100, 0, 0, 0, 20});
+constexpr preset_table_type DESAXE_PRESET = preset_table_type::generate(engine_preset{"desaxe", 50, 100, 12, 0, 0, 20});
+constexpr preset_table_type HORIZONTAL_PRESET = preset_table_type::generate(engine_preset{"horizontal", 40, 130, 0, 0, 20, 0});
+const preset_table_type* const PRESETS[] = { &DEFAULT_PRESET, &DESAXE_PRESET, &HORIZONTAL_PRESET };
+
+// Dead centers of the default geometry: the piston is at sqrt(100^2 - 50^2) at 0 and at 100 + 50 at 90 degrees
+static_assert(DEFAULT_PRESET.positions[0].piston_y > 86.602f && DEFAULT_PRESET.positions[0].piston_y < 86.603f, 
+  "Preset table at 0 degrees");
+static_assert(DEFAULT_PRESET.positions[PRESET_TABLE_SIZE / 4].piston_y > 149.999f && DEFAULT_PRESET.positions[PRESET_TABLE_SIZE / 4].piston_y < 150.001f, 
+  "Preset table at 90 degrees");
+
+// ==================== TRACE FILES =======================
+
+// Binary trace of the engine motion. The file starts with a self-describing header
+// followed by blocks of a fixed number of samples. Inside of a block each column is
+// stored separately as a fixed-width array aligned to 64 bytes, so the position of any 
+// value is known without reading anything but the header, and the file can be mapped
+// into memory and used in place. Values are stored in the little-endian byte order.
+//
+//   | header (512 bytes) | block 0: angle[], crankpin_x[], ..., exists[] | block 1 | ...
+//
+// The last block is padded to the full size. Readers use the sample count from the header.
+// Values are written and read in the host byte order, so the format is only supported on little-endian hosts.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Trace files are little-endian");
+const char TRACE_MAGIC[8] = {'P', 'I', 'S', 'T', 'O', 'N', 'T', 'R'};
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_HEADER_SIZE = 512;
+const uint32_t TRACE_ALIGNMENT = 64;
+const int TRACE_MAX_COLUMNS = 12;
+
+struct trace_column {
+  enum type : uint32_t { FLOAT32 = 1, UINT8 = 2 };
+  char name[16] = {};
+  uint32_t type = FLOAT32;
+  uint32_t width = 4;
+  // Byte offset of the column from the start of a block
+  uint64_t offset = 0;
+};
+
+struct trace_header {
+  char magic[8] = {};
+  uint32_t version = TRACE_VERSION;
+  uint32_t header_size = TRACE_HEADER_SIZE;
+  uint32_t column_count = 0;
+  uint32_t block_size = 0;
+  uint64_t block_stride = 0;
+  uint64_t sample_count = 0;
+  trace_column columns[TRACE_MAX_COLUMNS];
+};
+static_assert(sizeof(trace_header) <= TRACE_HEADER_SIZE, "Trace header doesn't fit");
+
+// Columns of the engine trace in the order they are stored in a block
+enum trace_columns { TRACE_ANGLE, TRACE_CRANKPIN_X, TRACE_CRANKPIN_Y, TRACE_PISTON_X, TRACE_PISTON_Y, TRACE_EXISTS, TRACE_COLUMN_COUNT };
+
+trace_header make_trace_header(const uint32_t block_size) {
+  const char* names[TRACE_COLUMN_COUNT] = { "angle", "crankpin_x", "crankpin_y", "piston_x", "piston_y", "exists" };
+  trace_header header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.column_count = TRACE_COLUMN_COUNT;
+  header.block_size = block_size;
+  uint64_t offset = 0;
+  for (int i = 0; i < TRACE_COLUMN_COUNT; i++) {
+    trace_column& column = header.columns[i];
+    strncpy(column.name, names[i], sizeof(column.name) - 1);
+    column.type = i == TRACE_EXISTS ? trace_column::UINT8 : trace_column::FLOAT32;
+    column.width = i == TRACE_EXISTS ? 1 : 4;
+    column.offset = offset;
+    offset += (uint64_t(block_size) * column.width + TRACE_ALIGNMENT - 1) / TRACE_ALIGNMENT * TRACE_ALIGNMENT;
+  }
+  header.block_stride = offset;
+  return header;
+}
+
+// Minimal io_uring submission and completion rings, set up with raw system calls.
+// Only used for writes of whole buffers at given offsets.
+#ifdef PISTON_IO_URING
+struct io_uring_queue {
+  int descriptor = -1;
+  unsigned entries = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_mask = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned* cq_mask = nullptr;
+  io_uring_sqe* sqes = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  void* sq_ring = MAP_FAILED;
+  void* cq_ring = MAP_FAILED;
+  size_t sq_ring_size = 0, cq_ring_size = 0;
+
+  bool open(const unsigned size) {
+    io_uring_params params = {};
+    descriptor = (int) syscall(__NR_io_uring_setup, size, &params);
+    if (descriptor < 0) return false;
+    entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) 
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_SQ_RING);
+    cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring
+      : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_CQ_RING);
+    void* sqe_ring = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), 
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqe_ring == MAP_FAILED) {
+      close();
+      return false;
+    }
+
+    uint8_t* sq = (uint8_t*) sq_ring;
+    uint8_t* cq = (uint8_t*) cq_ring;
+    sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*) (sq + params.sq_off.array);
+    cq_head = (unsigned*) (cq + params.cq_off.head);
+    cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+    sqes = (io_uring_sqe*) sqe_ring;
+    return true;
+  }
+
+  void close() {
+    if (sqes) munmap(sqes, entries * sizeof(io_uring_sqe));
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (descriptor >= 0) ::close(descriptor);
+    descriptor = -1;
+    sqes = nullptr;
+    sq_ring = cq_ring = MAP_FAILED;
+  }
+
+  // Queues the write and submits it to the kernel. If the submission fails, the entry stays 
+  // in the ring and the kernel can still consume it on the next call which submits entries,
+  // so after a failure nothing else may be submitted and the ring has to be closed 
+  // before the buffer is reused.
+  bool write(const int file, const void* data, const unsigned size, const uint64_t offset, const uint64_t user_data) {
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & *sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = file;
+    sqe.addr = (uint64_t) data;
+    sqe.len = size;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, descriptor, 1, 0, 0, nullptr, 0) == 1;
+  }
+
+  // Waits for at least one completion and passes every available one to the callback
+  template <typename F>
+  void complete(F&& callback) {
+    unsigned head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      syscall(__NR_io_uring_enter, descriptor, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+      const io_uring_cqe& cqe = cqes[head & *cq_mask];
+      callback(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+};
+#endif
+
+// Writes fixed-size buffers to a file on a background thread, so the thread which fills
+// the buffers never waits for the disk unless all buffers are in flight. Buffers are written 
+// with io_uring if the kernel allows it and with pwrite otherwise.
+struct async_file_writer {
+  // Backpressure metrics, can be read from any thread while the writer is running
+  struct backpressure {
+    std::atomic<uint64_t> buffers_written{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<int> queue_depth{0};
+    std::atomic<int> max_queue_depth{0};
+    // How many times and for how long the producer waited for a free buffer
+    std::atomic<uint64_t> stalls{0};
+    std::atomic<uint64_t> stall_nanoseconds{0};
+    std::atomic<bool> failed{false};
+  };
+
+  struct buffer {
+    std::vector<uint8_t> data;
+    uint64_t offset = 0;
+    size_t size = 0;
+  };
+
+  int descriptor = -1;
+  std::vector<buffer> buffers;
+  std::vector<int> free_buffers;
+  std::deque<int> queued_buffers;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+  bool stopping = false;
+  // Set by the writer thread once it knows whether the ring could be created
+  std::atomic<bool> io_uring{false};
+  backpressure metrics;
+
+  bool open(const char* path, const size_t buffer_size, const int buffer_count = 2) {
+    descriptor = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (descriptor < 0) return false;
+    buffers.assign(buffer_count, buffer());
+    free_buffers.clear();
+    for (int i = 0; i < buffer_count; i++) {
+      buffers[i].data.assign(buffer_size, 0);
+      free_buffers.push_back(i);
+    }
+    stopping = false;
+    thread = std::thread([this]() { run(); });
+    return true;
+  }
+
+  // Returns a free buffer, waits for the writer thread if there are none
+  int acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (free_buffers.empty()) {
+      const auto start = std::chrono::steady_clock::now();
+      changed.wait(lock, [this]() { return !free_buffers.empty(); });
+      metrics.stalls++;
+      metrics.stall_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    }
+    const int index = free_buffers.back();
+    free_buffers.pop_back();
+    return index;
+  }
+
+  uint8_t* data(const int index) { return buffers[index].data.data(); }
+
+  // Hands the first size bytes of the buffer to the writer thread
+  void submit(const int index, const uint64_t offset, const size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers[index].offset = offset;
+    buffers[index].size = size;
+    queued_buffers.push_back(index);
+    const int depth = ++metrics.queue_depth;
+    if (depth > metrics.max_queue_depth) metrics.max_queue_depth = depth;
+    changed.notify_all();
+  }
+
+  // Writes synchronously, bypassing the queue. Used for file headers.
+  bool write_now(const void* data, const size_t size, const uint64_t offset) {
+    return write_all(data, size, offset);
+  }
+
+  bool write_all(const void* data, size_t size, uint64_t offset) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    while (size > 0) {
+      const ssize_t written = pwrite(descriptor, bytes, size, offset);
+      if (written <= 0) return false;
+      bytes += written;
+      size -= written;
+      offset += written;
+    }
+    return true;
+  }
+
+  void release(const int index, const bool written) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (written) {
+      metrics.buffers_written++;
+      metrics.bytes_written += buffers[index].size;
+    } else {
+      metrics.failed = true;
+    }
+    metrics.queue_depth--;
+    free_buffers.push_back(index);
+    changed.notify_all();
+  }
+
+  // Takes the next queued buffer, returns -1 if there are none. Waits for new buffers 
+  // only if there is nothing else to do.
+  int next(const bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait) changed.wait(lock, [this]() { return stopping || !queued_buffers.empty(); });
+    if (queued_buffers.empty()) return -1;
+    const int index = queued_buffers.front();
+    queued_buffers.pop_front();
+    return index;
+  }
+
+  void run() {
+#ifdef PISTON_IO_URING
+    io_uring_queue queue;
+    io_uring = queue.open(std::max<unsigned>(2, buffers.size()));
+    int in_flight = 0;
+    // Buffer which couldn't be submitted, it's written with pwrite after the ring is closed
+    int unsubmitted = -1;
+    const auto completed = [&](const uint64_t index, const int result) {
+      const buffer& c = buffers[index];
+      in_flight--;
+      // Kernel without IORING_OP_WRITE or a short write, finish it with pwrite
+      const bool written = result == (int) c.size
+        || (result >= 0 ? write_all(c.data.data() + result, c.size - result, c.offset + result)
+                        : write_all(c.data.data(), c.size, c.offset));
+      release(index, written);
+    };
+    while (io_uring) {
+      const int index = next(in_flight == 0);
+      if (index < 0 && in_flight == 0) break;
+      if (index >= 0) {
+        const buffer& b = buffers[index];
+        if (!queue.write(descriptor, b.data.data(), b.size, b.offset, index)) {
+          unsubmitted = index;
+          break;
+        }
+        in_flight++;
+        // Keep submitting while there are queued buffers
+        if (in_flight < (int) buffers.size()) continue;
+      }
+      queue.complete(completed);
+    }
+    // Waiting for completions doesn't submit entries, so the unsubmitted one stays untouched
+    while (in_flight > 0) queue.complete(completed);
+    queue.close();
+    if (unsubmitted < 0 && io_uring) return;
+    // The rest is written with pwrite
+    if (unsubmitted >= 0) {
+      const buffer& b = buffers[unsubmitted];
+      release(unsubmitted, write_all(b.data.data(), b.size, b.offset));
+    }
+#endif
+    for (int index = next(true); index >= 0; index = next(true)) {
+      const buffer& b = buffers[index];
+      release(index, write_all(b.data.data(), b.size, b.offset));
+    }
+  }
+
+  // Waits until all submitted buffers are written
+  bool close() {
+    if (descriptor < 0) return false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      changed.notify_all();
+    }
+    thread.join();
+    const bool result = ::close(descriptor) == 0 && !metrics.failed;
+    descriptor = -1;
+    return result;
+  }
+};
+
+// Writes samples one by one. Samples are collected into a block buffer which is handed
+// to the background writer as soon as it's full, so writing never blocks the caller as long
+// as the disk keeps up. Sample count in the header is updated on close().
+struct trace_writer {
+  async_file_writer file;
+  trace_header header;
+  int block = -1;
+  uint64_t block_count = 0;
+  uint32_t block_samples = 0;
+
+  bool open(const char* path, const uint32_t block_size = 4096, const int buffer_count = 4) {
+    header = make_trace_header(block_size);
+    if (!file.open(path, header.block_stride, buffer_count)) return false;
+    block_count = 0;
+    block_samples = 0;
+    block = file.acquire();
+    memset(file.data(block), 0, header.block_stride);
+    if (write_header()) return true;
+    // Stops the writer thread and closes the file
+    file.close();
+    return false;
+  }
+
+  bool write_header() {
+    uint8_t bytes[TRACE_HEADER_SIZE] = {};
+    memcpy(bytes, &header, sizeof(header));
+    return file.write_now(bytes, sizeof(bytes), 0);
+  }
+
+  template <typename T>
+  T* column(const int index) { return (T*) (file.data(block) + header.columns[index].offset); }
+
+  void write(const float angle, const vec2& crankpin, const vec2& piston, const bool exists) {
+    const uint32_t i = block_samples;
+    column<float>(TRACE_ANGLE)[i] = angle;
+    column<float>(TRACE_CRANKPIN_X)[i] = crankpin.x;
+    column<float>(TRACE_CRANKPIN_Y)[i] = crankpin.y;
+    column<float>(TRACE_PISTON_X)[i] = piston.x;
+    column<float>(TRACE_PISTON_Y)[i] = piston.y;
+    column<uint8_t>(TRACE_EXISTS)[i] = exists;
+    header.sample_count++;
+    if (++block_samples == header.block_size) flush();
+  }
+
+  void write(const engine& engine) {
+    write(engine.crankshaft.angle, engine.crankshaft.crankpin_position, engine.piston.position, engine.piston.exists);
+  }
+
+  void flush() {
+    if (block_samples == 0) return;
+    // Padding of the last block must not contain values of the previous blocks
+    if (block_samples < header.block_size) {
+      for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+        const trace_column& column = header.columns[c];
+        memset(file.data(block) + column.offset + block_samples * column.width, 0, (header.block_size - block_samples) * column.width);
+      }
+    }
+    file.submit(block, TRACE_HEADER_SIZE + block_count * header.block_stride, header.block_stride);
+    block_count++;
+    block_samples = 0;
+    block = file.acquire();
+  }
+
+  bool close() {
+    if (file.descriptor < 0) return false;
+    flush();
+    const bool result = write_header();
+    return file.close() && result;
+  }
+};
+
+// Maps a trace file into memory. Values are read directly from the mapping,
+// nothing is copied or parsed except the header.
+struct trace_reader {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  trace_header header;
+  int columns[TRACE_COLUMN_COUNT] = {};
+  // Why the last open() failed
+  const char* error = nullptr;
+
+  bool open(const char* path) {
+    error = nullptr;
+    const int descriptor = ::open(path, O_RDONLY);
+    if (descriptor < 0) return fail("can't open the file");
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || (size_t) status.st_size < TRACE_HEADER_SIZE) {
+      ::close(descriptor);
+      return fail("the file is shorter than the header");
+    }
+    size = status.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+    ::close(descriptor);
+    if (mapping == MAP_FAILED) return fail("can't map the file");
+    data = (const uint8_t*) mapping;
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) return fail("wrong magic");
+    if (header.version != TRACE_VERSION) return fail("unsupported version");
+    if (header.column_count > TRACE_MAX_COLUMNS) return fail("too many columns");
+    if (header.block_size == 0 || header.block_stride == 0) return fail("empty blocks");
+    if (header.header_size < sizeof(trace_header) || header.header_size > size) return fail("wrong header size");
+    // Every value of every column has to be inside of its block. Written without sums which could overflow.
+    for (uint32_t c = 0; c < header.column_count; c++) {
+      const trace_column& column = header.columns[c];
+      const uint32_t width = column.type == trace_column::FLOAT32 ? 4 : column.type == trace_column::UINT8 ? 1 : 0;
+      if (width == 0 || column.width < width) return fail("wrong column type or width");
+      if (column.offset > header.block_stride 
+        || (uint64_t) column.width * header.block_size > header.block_stride - column.offset)
+        return fail("column doesn't fit into the block");
+    }
+    // Every block has to be inside of the file
+    const uint64_t block_count = header.sample_count / header.block_size + (header.sample_count % header.block_size != 0);
+    if (block_count > (size - header.header_size) / header.block_stride) return fail("file is truncated");
+
+    // Columns are found by name, so readers don't depend on the order of columns in the file
+    const trace_header expected = make_trace_header(header.block_size);
+    for (int i = 0; i < TRACE_COLUMN_COUNT; i++) {
+      columns[i] = -1;
+      for (uint32_t c = 0; c < header.column_count; c++) {
+        if (strncmp(header.columns[c].name, expected.columns[i].name, sizeof(expected.columns[i].name)) == 0 
+          && header.columns[c].type == expected.columns[i].type)
+          columns[i] = c;
+      }
+      if (columns[i] < 0) return fail("missing column");
+    }
+    return true;
+  }
+
+  bool fail(const char* reason) {
+    error = reason;
+    close();
+    return false;
+  }
+
+  void close() {
+    if (data) munmap((void*) data, size);
+    data = nullptr;
+    size = 0;
+  }
+
+  uint64_t sample_count() const { return header.sample_count; }
+
+  template <typename T>
+  T value(const int column, const uint64_t sample) const {
+    const trace_column& c = header.columns[columns[column]];
+    const uint64_t block = sample / header.block_size;
+    const uint64_t index = sample % header.block_size;
+    T result;
+    memcpy(&result, data + header.header_size + block * header.block_stride + c.offset + index * c.width, sizeof(T));
+    return result;
+  }
+
+  float angle(const uint64_t sample) const { return value<float>(TRACE_ANGLE, sample); }
+  vec2 crankpin_position(const uint64_t sample) const { 
+    return vec2(value<float>(TRACE_CRANKPIN_X, sample), value<float>(TRACE_CRANKPIN_Y, sample)); 
+  }
+  vec2 piston_position(const uint64_t sample) const { 
+    return vec2(value<float>(TRACE_PISTON_X, sample), value<float>(TRACE_PISTON_Y, sample)); 
+  }
+  bool exists(const uint64_t sample) const { return value<uint8_t>(TRACE_EXISTS, sample) != 0; }
+
+  // First sample with the angle not less than the given one. Angles must be increasing.
+  uint64_t find(const float angle) const {
+    uint64_t first = 0, count = sample_count();
+    while (count > 0) {
+      const uint64_t step = count / 2;
+      if (this->angle(first + step) < angle) {
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    return first;
+  }
+};
+
+// ================= TRACE COMPRESSION ====================
+
+// Lossy compression of binary traces. Values are quantized, so the error of every decoded 
+// value stays within the tolerance (plus rounding to float), then each quantized value is replaced with its difference
+// from a prediction (residual) and residuals are packed with the smallest bit width per block.
+//
+// Predictors for positions:
+//   PREVIOUS  - the previous value (delta encoding)
+//   LINEAR    - linear extrapolation of two previous values
+//   GEOMETRY  - positions solved by calculate_positions() for the decoded angle and the 
+//               engine dimensions stored in the file. Decoder has to solve the same equations,
+//               so files are decoded by the same build of the program which encoded them.
+// The angle column always uses the linear predictor and the exists column the previous one.
+const char COMPRESSED_TRACE_MAGIC[8] = {'P', 'I', 'S', 'T', 'O', 'N', 'Q', 'Z'};
+const uint32_t COMPRESSED_TRACE_VERSION = 1;
+
+struct compressed_trace_header {
+  char magic[8] = {};
+  uint32_t version = COMPRESSED_TRACE_VERSION;
+  uint32_t predictor = 0;
+  uint64_t sample_count = 0;
+  float tolerance = 0;
+  float angle_tolerance = 0;
+  float parameters[engine::PARAMETER_COUNT] = {};
+  uint64_t column_sizes[TRACE_COLUMN_COUNT] = {};
+};
+
+struct trace_codec {
+  enum predictor : uint32_t { PREVIOUS, LINEAR, GEOMETRY };
+  static const int PACK_SIZE = 128;
+  // Packed streams are padded, so the decoder can always load 8 bytes at once
+  static const int PADDING = 8;
+
+  // Columns of the trace as arrays, one value per sample
+  struct columns {
+    std::vector<float> values[TRACE_COLUMN_COUNT];
+    size_t size() const { return values[TRACE_ANGLE].size(); }
+  };
+
+  compressed_trace_header header;
+
+  static uint64_t zigzag(const int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+  static int64_t unzigzag(const uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+  // Every block starts with the bit width of its residuals followed by the residuals
+  // packed from the least significant bit
+  static void pack(const int64_t* residuals, const size_t count, std::vector<uint8_t>& output) {
+    for (size_t start = 0; start < count; start += PACK_SIZE) {
+      const size_t size = std::min<size_t>(PACK_SIZE, count - start);
+      uint64_t all = 0;
+      for (size_t i = 0; i < size; i++) all |= zigzag(residuals[start + i]);
+      int width = 0;
+      while (width < 64 && (all >> width) != 0) width++;
+      output.push_back(uint8_t(width));
+
+      const size_t offset = output.size();
+      output.resize(offset + (size * width + 7) / 8, 0);
+      uint8_t* bytes = output.data() + offset;
+      for (size_t i = 0; i < size; i++) {
+        const uint64_t value = zigzag(residuals[start + i]);
+        for (int bit = 0; bit < width; bit++) {
+          const size_t position = i * width + bit;
+          bytes[position / 8] |= uint8_t(((value >> bit) & 1) << (position % 8));
+        }
+      }
+    }
+    output.insert(output.end(), PADDING, 0);
+  }
+
+  // Returns nullptr if the stream ends before count residuals (and the padding) are read
+  static const uint8_t* unpack(const uint8_t* input, const uint8_t* end, const size_t count, int64_t* residuals) {
+    for (size_t start = 0; start < count; start += PACK_SIZE) {
+      const size_t size = std::min<size_t>(PACK_SIZE, count - start);
+      if (end - input < 1) return nullptr;
+      const int width = *input++;
+      // The block and the padding after it, which is read by the 8-byte loads of the last values
+      if (width > 64 || (size_t) (end - input) < (size * width + 7) / 8 + PADDING) return nullptr;
+      const uint64_t mask = width == 64 ? ~0ull : (1ull << width) - 1;
+      for (size_t i = 0; i < size; i++) {
+        const size_t position = i * width;
+        const int shift = position % 8;
+        uint64_t word;
+        memcpy(&word, input + position / 8, sizeof(word));
+        uint64_t value = word >> shift;
+        // Values wider than 56 bits may continue in the ninth byte
+        if (shift + width > 64) value |= uint64_t(input[position / 8 + 8]) << (64 - shift);
+        residuals[start + i] = unzigzag(value & mask);
+      }
+      input += (size * width + 7) / 8;
+    }
+    return input + PADDING;
+  }
+
+  // Quantization is done in double precision. Recorded angles keep growing and a float
+  // can't hold the product of a large quantized angle and a small step.
+  double step(const int column) const {
+    if (column == TRACE_EXISTS) return 1;
+    return 2. * (column == TRACE_ANGLE ? header.angle_tolerance : header.tolerance);
+  }
+
+  int64_t quantize(const int column, const float value) const { return llround(value / step(column)); }
+  float dequantize(const int column, const int64_t value) const { return float(value * step(column)); }
+
+  // Predicts quantized positions of the sample from already known values: all values
+  // of the angle and exists columns and positions of the previous samples
+  void predict(engine& engine, const std::vector<int64_t> (&q)[TRACE_COLUMN_COUNT], const size_t i, int64_t (&prediction)[TRACE_COLUMN_COUNT]) const {
+    for (int c = TRACE_CRANKPIN_X; c <= TRACE_PISTON_Y; c++) {
+      if (i == 0) prediction[c] = 0;
+      else if (i == 1 || header.predictor == PREVIOUS) prediction[c] = q[c][i - 1];
+      else prediction[c] = 2 * q[c][i - 1] - q[c][i - 2];
+    }
+    if (header.predictor != GEOMETRY) return;
+
+    engine.crankshaft.angle = dequantize(TRACE_ANGLE, q[TRACE_ANGLE][i]);
+    engine.calculate_positions();
+    prediction[TRACE_CRANKPIN_X] = quantize(TRACE_CRANKPIN_X, engine.crankshaft.crankpin_position.x);
+    prediction[TRACE_CRANKPIN_Y] = quantize(TRACE_CRANKPIN_Y, engine.crankshaft.crankpin_position.y);
+    // Without the piston the trace keeps its last position
+    if (engine.piston.exists) {
+      prediction[TRACE_PISTON_X] = quantize(TRACE_PISTON_X, engine.piston.position.x);
+      prediction[TRACE_PISTON_Y] = quantize(TRACE_PISTON_Y, engine.piston.position.y);
+    }
+  }
+
+  engine make_engine() const {
+    ::engine engine;
+    engine.crankshaft.crank_radius = header.parameters[engine::CRANK_RADIUS];
+    engine.connecting_rod_length = header.parameters[engine::CONNECTING_ROD_LENGTH];
+    engine.cylinder.origin = vec2(header.parameters[engine::ORIGIN_X], header.parameters[engine::ORIGIN_Y]);
+    engine.cylinder.direction = vec2(header.parameters[engine::DIRECTION_X], header.parameters[engine::DIRECTION_Y]);
+    return engine;
+  }
+
+  // Header has to be filled in, except for the sizes of the columns
+  std::vector<uint8_t> encode(const columns& input) {
+    const size_t count = input.size();
+    header.sample_count = count;
+    memcpy(header.magic, COMPRESSED_TRACE_MAGIC, sizeof(header.magic));
+
+    std::vector<int64_t> q[TRACE_COLUMN_COUNT];
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+      q[c].resize(count);
+      for (size_t i = 0; i < count; i++) q[c][i] = quantize(c, input.values[c][i]);
+    }
+
+    std::vector<int64_t> residuals[TRACE_COLUMN_COUNT];
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) residuals[c].resize(count);
+    engine engine = make_engine();
+    int64_t prediction[TRACE_COLUMN_COUNT];
+    for (size_t i = 0; i < count; i++) {
+      const int64_t previous_angle = i > 0 ? q[TRACE_ANGLE][i - 1] : 0;
+      const int64_t angle_step = i > 1 ? previous_angle - q[TRACE_ANGLE][i - 2] : 0;
+      residuals[TRACE_ANGLE][i] = q[TRACE_ANGLE][i] - (previous_angle + angle_step);
+      residuals[TRACE_EXISTS][i] = q[TRACE_EXISTS][i] - (i > 0 ? q[TRACE_EXISTS][i - 1] : 0);
+      predict(engine, q, i, prediction);
+      for (int c = TRACE_CRANKPIN_X; c <= TRACE_PISTON_Y; c++) residuals[c][i] = q[c][i] - prediction[c];
+    }
+
+    std::vector<uint8_t> output(sizeof(header));
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+      const size_t start = output.size();
+      pack(residuals[c].data(), count, output);
+      header.column_sizes[c] = output.size() - start;
+    }
+    memcpy(output.data(), &header, sizeof(header));
+    return output;
+  }
+
+  // Returns false if the data is not a compressed trace or is corrupt or truncated
+  bool decode(const uint8_t* data, const size_t size, columns& output) {
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, COMPRESSED_TRACE_MAGIC, sizeof(header.magic)) != 0 
+      || header.version != COMPRESSED_TRACE_VERSION) return false;
+    // Every column has to fit into the rest of the input. A block of PACK_SIZE residuals takes
+    // at least one byte, which bounds the sample count before anything is allocated.
+    const size_t count = header.sample_count;
+    uint64_t remaining = size - sizeof(header);
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+      const uint64_t column_size = header.column_sizes[c];
+      if (column_size > remaining || column_size < PADDING) return false;
+      if (count / PACK_SIZE > column_size - PADDING) return false;
+      remaining -= column_size;
+    }
+
+    std::vector<int64_t> q[TRACE_COLUMN_COUNT];
+    const uint8_t* stream = data + sizeof(header);
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+      q[c].resize(count);
+      if (!unpack(stream, stream + header.column_sizes[c], count, q[c].data())) return false;
+      stream += header.column_sizes[c];
+    }
+
+    // Residuals are turned into values in place
+    for (size_t i = 0; i < count; i++) {
+      if (i > 1) q[TRACE_ANGLE][i] += 2 * q[TRACE_ANGLE][i - 1] - q[TRACE_ANGLE][i - 2];
+      else if (i == 1) q[TRACE_ANGLE][i] += q[TRACE_ANGLE][0];
+      if (i > 0) q[TRACE_EXISTS][i] += q[TRACE_EXISTS][i - 1];
+    }
+    engine engine = make_engine();
+    int64_t prediction[TRACE_COLUMN_COUNT];
+    for (size_t i = 0; i < count; i++) {
+      predict(engine, q, i, prediction);
+      for (int c = TRACE_CRANKPIN_X; c <= TRACE_PISTON_Y; c++) q[c][i] += prediction[c];
+    }
+
+    for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+      output.values[c].resize(count);
+      for (size_t i = 0; i < count; i++) output.values[c][i] = dequantize(c, q[c][i]);
+    }
+    return true;
+  }
+};
+
+// ================ PERFORMANCE COUNTERS ==================
+
+// Hardware performance counters of the calling thread read with perf_event_open.
+// Every counter is opened on its own, so the counters which the CPU or the kernel 
+// (perf_event_paranoid, containers, virtual machines) doesn't provide are reported as unavailable 
+// while the rest still work. Only user space is counted.
+// Values are scaled by the time the counter was actually running in case the kernel multiplexes them.
+struct perf_counters {
+  enum counter { CYCLES, INSTRUCTIONS, BRANCH_MISSES, CACHE_MISSES, COUNTER_COUNT };
+  static constexpr const char* COUNTER_NAMES[COUNTER_COUNT] = { "cycles", "instructions", "branch misses", "cache misses" };
+
+  struct sample {
+    double values[COUNTER_COUNT] = {};
+    double nanoseconds = 0;
+  };
+
+  int descriptors[COUNTER_COUNT] = { -1, -1, -1, -1 };
+  std::chrono::steady_clock::time_point start_time;
+
+  ~perf_counters() {
+    for (int& descriptor: descriptors) {
+      if (descriptor >= 0) ::close(descriptor);
+      descriptor = -1;
+    }
+  }
+
+  // Returns number of counters that could be opened
+  int open() {
+    int opened = 0;
+#ifdef PISTON_PERF_EVENTS
+    const uint64_t configs[COUNTER_COUNT] = { 
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES 
+    };
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+      perf_event_attr attributes;
+      memset(&attributes, 0, sizeof(attributes));
+      attributes.type = PERF_TYPE_HARDWARE;
+      attributes.size = sizeof(attributes);
+      attributes.config = configs[c];
+      attributes.disabled = 1;
+      attributes.exclude_kernel = 1;
+      attributes.exclude_hv = 1;
+      attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      descriptors[c] = (int) syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+      if (descriptors[c] >= 0) opened++;
+    }
+#endif
+    return opened;
+  }
+
+  bool available(const counter c) const { return descriptors[c] >= 0; }
+
+  void start() {
+#ifdef PISTON_PERF_EVENTS
+    for (const int descriptor: descriptors) {
+      if (descriptor < 0) continue;
+      ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+      ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    start_time = std::chrono::steady_clock::now();
+  }
+
+  // Adds values counted since start() to the sample
+  void stop(sample& sample) {
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start_time;
+    sample.nanoseconds += elapsed.count();
+#ifdef PISTON_PERF_EVENTS
+    for (const int descriptor: descriptors) if (descriptor >= 0) ioctl(descriptor, PERF_EVENT_IOC_DISABLE, 0);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+      if (descriptors[c] < 0) continue;
+      // value, time enabled, time running
+      uint64_t values[3] = {};
+      if (::read(descriptors[c], values, sizeof(values)) != sizeof(values) || values[2] == 0) continue;
+      sample.values[c] += (double) values[0] * values[1] / values[2];
+    }
+#else
+    (void) sample;
+#endif
+  }
+};
+
+// Measures the kinematics kernels in batches with the hardware counters around every batch.
+// Inputs of a batch are prepared before the counters are started, so only the kernel itself is measured.
+// Cases separate the costs of the solver:
+//   calculate_positions       - the piston always reaches the cylinder, branches are perfectly predicted
+//   unreachable 50%           - connecting rod randomly too short for half of the samples, 
+//                               so the "discriminant < 0" branch is unpredictable
+//   cos + sin, sqrt           - the math library calls alone, as many as in one calculate_positions()
+//   sensitivities             - the same kernel with dual numbers
+struct kernel_benchmark {
+  enum kernel { CALCULATE_POSITIONS, UNREACHABLE, TRIGONOMETRY, SQUARE_ROOT, SENSITIVITIES, KERNEL_COUNT };
+  static constexpr const char* KERNEL_NAMES[KERNEL_COUNT] = { 
+    "calculate_positions", "unreachable 50%", "cos + sin", "sqrt", "sensitivities" 
+  };
+
+  int batch_size = 4096;
+  int batches = 1000;
+  uint64_t seed = 1;
+
+  perf_counters counters;
+  perf_counters::sample samples[KERNEL_COUNT];
+  // Results are accumulated, so the compiler can't remove the calculation
+  volatile float sink = 0;
+
+  void run() {
+    std::vector<float> angles(batch_size), lengths(batch_size);
+    for (int b = 0; b < batches; b++) {
+      const uint64_t counter = (uint64_t) b * batch_size;
+      for (int i = 0; i < batch_size; i++) {
+        angles[i] = random_float(seed, (counter + i) * 2) * 2 * pi<float>();
+        // Rod length 100 always reaches the cylinder, 30 never reaches it with crank radius 50 
+        lengths[i] = random_bits(seed, (counter + i) * 2 + 1) & 1 ? 100 : 30;
+      }
+      for (int k = 0; k < KERNEL_COUNT; k++) run_batch((kernel) k, angles.data(), lengths.data(), samples[k]);
+    }
+  }
+
+  void run_batch(const kernel kernel, const float* angles, const float* lengths, perf_counters::sample& sample) {
+    engine engine;
+    float sum = 0;
+    counters.start();
+    switch (kernel) {
+      case CALCULATE_POSITIONS:
+        for (int i = 0; i < batch_size; i++) {
+          engine.crankshaft.angle = angles[i];
+          engine.calculate_positions();
+          sum += engine.piston.position.y;
+        }
+        break;
+      case UNREACHABLE:
+        for (int i = 0; i < batch_size; i++) {
+          engine.crankshaft.angle = angles[i];
+          engine.connecting_rod_length = lengths[i];
+          engine.calculate_positions();
+          sum += engine.piston.exists ? engine.piston.position.y : 0;
+        }
+        break;
+      case TRIGONOMETRY:
+        for (int i = 0; i < batch_size; i++) sum += cos(angles[i]) + sin(angles[i]);
+        break;
+      case SQUARE_ROOT:
+        // One for the direction length and one for the discriminant
+        for (int i = 0; i < batch_size; i++) sum += sqrt(angles[i]) + sqrt(lengths[i] + angles[i]);
+        break;
+      case SENSITIVITIES:
+        for (int i = 0; i < batch_size; i++) {
+          engine.crankshaft.angle = angles[i];
+          sum += engine.sensitivities().derivatives[engine::ANGLE].y;
+        }
+        break;
+      default: break;
+    }
+    counters.stop(sample);
+    sink = sink + sum;
+  }
+};
+
+// ================= SIMULATION HISTORY ===================
+
+// Fixed-capacity ring buffer of the engine states, one per simulation step, so the simulation 
+// can be paused and scrubbed back in time. A state takes 12 bytes: the angle is quantized
+// to 16 bits (0.0001 rad) and positions to 16 bits with a step of 1/32 (range of +-1024).
+// With 8 MB that's about 3 hours of history at 60 steps per second.
+// Since every step takes the same time, the state at any time is found with an index.
+struct history {
+  struct state {
+    uint16_t angle = 0;
+    int16_t crankpin_x = 0, crankpin_y = 0;
+    int16_t piston_x = 0, piston_y = 0;
+    uint16_t exists = 0;
+  };
+  static constexpr float POSITION_STEP = 1.f / 32;
+  static constexpr float ANGLE_STEP = 2 * pi<float>() / 65536;
+
+  std::vector<state> states;
+  // Index of the next state to write
+  size_t head = 0;
+  size_t count = 0;
+
+  void set_budget(const size_t bytes) {
+    states.assign(std::max<size_t>(1, bytes / sizeof(state)), state{});
+    head = 0;
+    count = 0;
+  }
+
+  size_t size() const { return count; }
+  size_t capacity() const { return states.size(); }
+
+  static int16_t quantize(const float value) {
+    return (int16_t) clamp((int) lround(value / POSITION_STEP), -32768, 32767);
+  }
+
+  void push(const engine& engine) {
+    const float angle = engine.crankshaft.angle - 2 * pi<float>() * floor(engine.crankshaft.angle / (2 * pi<float>()));
+    state& s = states[head];
+    s.angle = (uint16_t) (lround(angle / ANGLE_STEP) & 0xFFFF);
+    s.crankpin_x = quantize(engine.crankshaft.crankpin_position.x);
+    s.crankpin_y = quantize(engine.crankshaft.crankpin_position.y);
+    s.piston_x = quantize(engine.piston.position.x);
+    s.piston_y = quantize(engine.piston.position.y);
+    s.exists = engine.piston.exists;
+    head = (head + 1) % states.size();
+    count = std::min(count + 1, states.size());
+  }
+
+  // State which is the given number of steps older than the newest one
+  const state& at(const size_t steps_back) const {
+    return states[(head + states.size() - 1 - steps_back) % states.size()];
+  }
+
+  void restore(const size_t steps_back, engine& engine) const {
+    const state& s = at(steps_back);
+    engine.crankshaft.angle = s.angle * ANGLE_STEP;
+    engine.crankshaft.crankpin_position = vec2(s.crankpin_x, s.crankpin_y) * POSITION_STEP;
+    engine.piston.position = vec2(s.piston_x, s.piston_y) * POSITION_STEP;
+    engine.piston.exists = s.exists;
+  }
+
+  // Forgets the given number of the newest states
+  void drop(const size_t steps) {
+    const size_t dropped = std::min(steps, count);
+    head = (head + states.size() - dropped) % states.size();
+    count -= dropped;
+  }
+};
+
+// Piston displacement along the cylinder, velocity and acceleration at every simulation step for plotting.
+// A plot has only a few hundred pixel columns, but may show millions of steps, so for every column 
+// only the min and the max of its steps are needed. They are precomputed in a pyramid: the level k 
+// has the min and the max of every block of 2^k steps. A column is covered by at most 4 blocks 
+// of the level whose blocks are just smaller than the column, so plotting takes the same time for 
+// any number of steps. Every new value updates one block per level.
+// Blocks are aligned to the absolute step number, so the ring buffers of all levels wrap consistently.
+struct plot_history {
+  enum signal { DISPLACEMENT, VELOCITY, ACCELERATION, SIGNAL_COUNT };
+  static constexpr const char* SIGNAL_NAMES[SIGNAL_COUNT] = { "displacement", "velocity", "acceleration" };
+
+  struct range {
+    float min = 0;
+    float max = 0;
+  };
+
+  // Power of two
+  size_t capacity = 0;
+  int levels = 0;
+  // Number of steps pushed since the start and how many of them are stored
+  uint64_t total = 0;
+  size_t count = 0;
+  std::vector<float> values[SIGNAL_COUNT];
+  // Levels from 1, level 0 are the values themselves
+  std::vector<std::vector<range>> pyramid[SIGNAL_COUNT];
+
+  void set_capacity(const size_t samples) {
+    capacity = 2;
+    levels = 1;
+    while (capacity < samples) {
+      capacity *= 2;
+      levels++;
+    }
+    total = 0;
+    count = 0;
+    for (int s = 0; s < SIGNAL_COUNT; s++) {
+      values[s].assign(capacity, 0);
+      pyramid[s].resize(levels - 1);
+      for (int k = 1; k < levels; k++) pyramid[s][k - 1].assign(capacity >> k, range{});
+    }
+  }
+
+  float newest(const signal s, const size_t back = 0) const { return values[s][(total - 1 - back) % capacity]; }
+
+  // Values are calculated with finite differences from the previous steps
+  void push(const engine& engine) {
+    float v[SIGNAL_COUNT] = {};
+    v[DISPLACEMENT] = count > 0 ? newest(DISPLACEMENT) : 0;
+    if (engine.piston.exists) 
+      v[DISPLACEMENT] = dot(engine.piston.position - engine.cylinder.origin, normalize(engine.cylinder.direction));
+    if (count > 0) v[VELOCITY] = (v[DISPLACEMENT] - newest(DISPLACEMENT)) / SIMULATION_STEP;
+    if (count > 1) v[ACCELERATION] = (v[VELOCITY] - newest(VELOCITY)) / SIMULATION_STEP;
+
+    for (int s = 0; s < SIGNAL_COUNT; s++) {
+      values[s][total % capacity] = v[s];
+      for (int k = 1; k < levels; k++) {
+        range& r = pyramid[s][k - 1][(total >> k) % (capacity >> k)];
+        // The first step of a block
+        if ((total & ((1ull << k) - 1)) == 0) r = range{v[s], v[s]};
+        else r = range{std::min(r.min, v[s]), std::max(r.max, v[s])};
+      }
+    }
+    total++;
+    count = std::min(count + 1, capacity);
+  }
+
+  // Forgets the given number of the newest steps. The newest block of every level 
+  // includes forgotten steps, so it's calculated again from the values.
+  void drop(const size_t steps) {
+    const uint64_t oldest = total - count;
+    const size_t dropped = std::min(steps, count);
+    total -= dropped;
+    count -= dropped;
+    if (dropped == 0 || count == 0) return;
+    for (int s = 0; s < SIGNAL_COUNT; s++) {
+      for (int k = 1; k < levels; k++) {
+        const uint64_t block = (total - 1) >> k;
+        range r{INFINITY, -INFINITY};
+        for (uint64_t i = std::max(block << k, oldest); i < total; i++) {
+          r.min = std::min(r.min, values[s][i % capacity]);
+          r.max = std::max(r.max, values[s][i % capacity]);
+        }
+        pyramid[s][k - 1][block % (capacity >> k)] = r;
+      }
+    }
+  }
+
+  // Min and max of the signal for every column, columns evenly split the last window steps
+  void columns(const signal s, size_t window, const int column_count, range* output) const {
+    window = std::min(window, count);
+    const double steps = (double) window / column_count;
+    int level = 0;
+    while (level + 1 < levels && (double) (1ull << (level + 1)) <= steps) level++;
+
+    for (int c = 0; c < column_count; c++) {
+      const uint64_t start = total - window + (uint64_t) (c * steps);
+      const uint64_t end = std::max(start + 1, total - window + (uint64_t) ((c + 1) * steps));
+      range r{INFINITY, -INFINITY};
+      if (level == 0) {
+        for (uint64_t i = start; i < std::min(end, total); i++) {
+          r.min = std::min(r.min, values[s][i % capacity]);
+          r.max = std::max(r.max, values[s][i % capacity]);
+        }
+      } else {
+        const uint64_t newest_block = (total - 1) >> level;
+        for (uint64_t block = start >> level; block <= (end - 1) >> level; block++) {
+          // The oldest block may be partly overwritten by the newest one, its remaining values are used instead
+          if (block + (capacity >> level) <= newest_block) {
+            for (uint64_t i = std::max(block << level, (uint64_t) (total - count)); i < (block + 1) << level; i++) {
+              r.min = std::min(r.min, values[s][i % capacity]);
+              r.max = std::max(r.max, values[s][i % capacity]);
+            }
+            continue;
+          }
+          const range& b = pyramid[s][level - 1][block % (capacity >> level)];
+          r.min = std::min(r.min, b.min);
+          r.max = std::max(r.max, b.max);
+        }
+      }
+      output[c] = r;
+    }
+  }
+};
+
+// ================== RENDER STRUCTURES ===================
+
+// Defines a 2D camera which can be scaled, moved around and rotated.
+// There are 2 type of coordinates: world coordinates and display coordinates.
+// World coordinates are coordinates in which we define all vectors for calculations (millimeters).
+// Display coordinates are coordinates which describe where on the screen objects are rendered (pixels).
+struct view {
+
+  mat3 view = glm::translate(glm::scale(mat3(1.), vec2(1, -1)), vec2(WINDOW_WIDTH / 2, -WINDOW_HEIGHT / 2));
+  void translate(const vec2& vec) { view = glm::translate(view, vec); }
+  void scale(const float& value) { view = glm::scale(view, vec2(value, value)); }
+
+  // From world size to display size
+  float transform(const float value) const {
+    const vec3 v = view * vec3(value, 0, 0);
+    return length(v);
+  }
+
+  // From display size to world size
+  float inverse_transform(const float value) const {
+    const vec3 v = inverse(view) * vec3(value, 0, 0);
+    return length(v);
+  }
+
+  // From display coordinates to world coordinates
+  vec2 inverse_transform(const Vector2& vector) const {
+    const vec3 v = inverse(view) * vec3(vector.x, vector.y, 1.f);
+    return vec2{v.x, v.y};
+  }
+
+  // From world coordinates to display coordinates
+  Vector2 transform(const vec2& vector) const {
+    const vec3 v = view * vec3(vector, 1.f);
+    return Vector2{v.x, v.y};
+  }
+
+};
+
+// Positions of the moving parts at evenly spaced crank angles between two frames.
+// Drawing all of them shows the motion during the frame instead of a single instant, 
+// which prevents the stroboscopic effect at high speed.
+struct motion_blur {
+  // Faster motion gets more positions, so they are at most 5 degrees apart
+  static constexpr float MAX_ANGLE_STEP = 2 * glm::pi<float>() / 72;
+  bool enabled = false;
+  // Smallest number of positions per frame
+  int samples = 32;
+  std::vector<float> angles;
+  std::vector<vec2> crankpins;
+  std::vector<vec2> pistons;
+  std::vector<uint8_t> exists;
+
+  // Samples angles in (from, from + sweep] with a single call of the solver
+  void update(const engine& engine, const float from, const float sweep) {
+    // After a full turn within a frame the parts have been at every position, more turns don't change
+    // how the blur looks. That also caps the number of positions at 72 (or samples if it's larger).
+    const float covered = clamp(sweep, -2 * pi<float>(), 2 * pi<float>());
+    const int count = std::max(samples, (int) ceil(abs(covered) / MAX_ANGLE_STEP));
+    angles.resize(count);
+    crankpins.resize(count);
+    pistons.resize(count);
+    exists.resize(count);
+    for (int i = 0; i < count; i++) angles[i] = from + covered * (i + 1) / count;
+    engine.calculate_positions(count, angles.data(), crankpins.data(), pistons.data(), exists.data());
+  }
+};
+
+// Fading trails of the crankpin, the piston and points on the connecting rod.
+// Points of the trails are the last states of the history, so trails follow scrubbing as well.
+struct trails {
+  bool enabled = false;
+  // Number of simulation steps in a trail
+  int length = 600;
+  // Points on the connecting rod, 0 is the crankpin and 1 is the piston
+  std::vector<float> rod_points = { 0, 1 };
+};
+
+// Static part of the scene rendered into a texture, which is composited every frame instead of 
+// drawing everything again. Compositing costs a textured quad over the whole window, so it's only worth it 
+// for layers with many draw calls which rarely change. The key has to include everything the layer 
+// depends on (usually the view matrix). The texture is rendered only after the key stayed the same for 
+// two frames. While the key keeps changing (panning and zooming) the layer is drawn directly.
+//
+// Render textures have no multisampling, so the texture has twice the resolution of the framebuffer
+// and is drawn with bilinear filtering, which averages 2x2 samples for every pixel like 4x MSAA.
+// The texture keeps colors premultiplied by alpha. Otherwise the alpha of a semi-transparent layer 
+// would be applied twice: when it's drawn into the texture and when the texture is composited.
+struct layer_cache {
+  static const int SUPERSAMPLING = 2;
+  RenderTexture2D texture = {};
+  // Key of the layer in the texture and of the previous frame
+  std::vector<uint8_t> key;
+  std::vector<uint8_t> previous_key;
+
+  template <typename Key, typename F>
+  void draw(const Key& value, F draw_layer) {
+    const uint8_t* bytes = (const uint8_t*) &value;
+    const bool stable = previous_key.size() == sizeof(Key) && memcmp(previous_key.data(), bytes, sizeof(Key)) == 0;
+    previous_key.assign(bytes, bytes + sizeof(Key));
+
+    const int width = GetRenderWidth() * SUPERSAMPLING;
+    const int height = GetRenderHeight() * SUPERSAMPLING;
+    const bool resized = texture.id == 0 || texture.texture.width != width || texture.texture.height != height;
+    const bool cached = !resized && key.size() == sizeof(Key) && memcmp(key.data(), bytes, sizeof(Key)) == 0;
+    if (!cached && !stable) {
+      draw_layer();
+      return;
+    }
+
+    if (!cached) {
+      if (resized) {
+        unload();
+        texture = LoadRenderTexture(width, height);
+        SetTextureFilter(texture.texture, TEXTURE_FILTER_BILINEAR);
+      }
+      key.assign(bytes, bytes + sizeof(Key));
+      BeginTextureMode(texture);
+      ClearBackground(BLANK);
+      // Drawing is done in window coordinates, lines keep their width in pixels of the window
+      rlScalef((float) width / WINDOW_WIDTH, (float) height / WINDOW_HEIGHT, 1);
+      rlSetLineWidth(SUPERSAMPLING);
+      // Color is blended as usual, which premultiplies it, and alpha accumulates the coverage
+      rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE, RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD, RL_FUNC_ADD);
+      BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+      draw_layer();
+      EndBlendMode();
+      EndTextureMode();
+      rlSetLineWidth(1);
+    }
+
+    // Render textures are stored upside down
+    const Rectangle source{0, 0, (float) texture.texture.width, (float) -texture.texture.height};
+    BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+    DrawTexturePro(texture.texture, source, Rectangle{0, 0, WINDOW_WIDTH, WINDOW_HEIGHT}, Vector2{0, 0}, 0, WHITE);
+    EndBlendMode();
+  }
+
+  void unload() {
+    if (texture.id != 0) UnloadRenderTexture(texture);
+    texture = {};
+    key.clear();
+  }
+};
+
+// Static layers of the scene
+struct scene_layers {
+  layer_cache coordinates;
+
+  void unload() {
+    coordinates.unload();
+  }
+};
+
+// Source of the user input for a frame. In the live mode it reads raylib directly.
+// It can also record every frame into a file, or replay a recorded file instead of
+// reading raylib, in which case every frame takes exactly the recorded frame time.
+// That makes interactive sessions reproducible, so they can be used as benchmarks.
+//
+// The file starts with a header followed by frames. Consecutive identical frames are
+// stored once together with the number of repeats, so idle periods cost nothing.
+struct input {
+  enum class mode { LIVE, RECORD, REPLAY };
+
+  // Keys which are tracked by the input. Frames store one bit per key in this order,
+  // new keys must be added to the end to keep old recordings valid.
+  static constexpr int KEYS[] = { KEY_W, KEY_A, KEY_S, KEY_D, KEY_F1, KEY_SPACE, KEY_LEFT, KEY_RIGHT, KEY_M, KEY_T, KEY_P };
+  static constexpr int KEY_COUNT = sizeof(KEYS) / sizeof(KEYS[0]);
+
+  struct frame {
+    float mouse_x = 0;
+    float mouse_y = 0;
+    float mouse_wheel = 0;
+    uint32_t keys = 0;
+    uint32_t buttons = 0;
+
+    bool operator==(const frame& other) const { return memcmp(this, &other, sizeof(frame)) == 0; }
+  };
+
+  struct header {
+    char magic[8] = {'P', 'I', 'S', 'T', 'O', 'N', 'I', 'N'};
+    uint32_t version = 1;
+    float frame_time = 1.f / TARGET_FPS;
+  };
+
+  mode mode = mode::LIVE;
+  FILE* file = nullptr;
+  header header;
+  frame current;
+  frame previous;
+  // Number of times the current frame is repeated (recording) or is still to be repeated (replay)
+  uint32_t repeats = 0;
+  bool finished = false;
+
+  bool open(const char* path, const enum mode m) {
+    mode = m;
+    file = fopen(path, mode == mode::RECORD ? "wb" : "rb");
+    if (!file) return false;
+    if (mode == mode::RECORD) return fwrite(&header, sizeof(header), 1, file) == 1;
+
+    const struct header expected;
+    return fread(&header, sizeof(header), 1, file) == 1 
+      && memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 
+      && header.version == expected.version;
+  }
+
+  // Reads the input for the next frame. Must be called once at the start of every frame.
+  void update() {
+    previous = current;
+    if (mode == mode::REPLAY) {
+      if (repeats == 0 && (fread(&current, sizeof(current), 1, file) != 1 || fread(&repeats, sizeof(repeats), 1, file) != 1)) {
+        finished = true;
+        return;
+      }
+      repeats--;
+      return;
+    }
+
+    const Vector2 mouse = GetMousePosition();
+    current = frame();
+    current.mouse_x = mouse.x;
+    current.mouse_y = mouse.y;
+    current.mouse_wheel = GetMouseWheelMove();
+    current.buttons = IsMouseButtonDown(MOUSE_BUTTON_LEFT);
+    for (int i = 0; i < KEY_COUNT; i++) current.keys |= uint32_t(IsKeyDown(KEYS[i])) << i;
+
+    if (mode == mode::RECORD) {
+      if (repeats > 0 && !(current == previous)) write();
+      repeats++;
+    }
+  }
+
+  void write() {
+    fwrite(&previous, sizeof(previous), 1, file);
+    fwrite(&repeats, sizeof(repeats), 1, file);
+    repeats = 0;
+  }
+
+  void close() {
+    if (!file) return;
+    if (mode == mode::RECORD && repeats > 0) {
+      previous = current;
+      write();
+    }
+    fclose(file);
+    file = nullptr;
+  }
+
+  float frame_time() const { return mode == mode::REPLAY ? header.frame_time : GetFrameTime(); }
+  Vector2 mouse_position() const { return Vector2{current.mouse_x, current.mouse_y}; }
+  float mouse_wheel() const { return current.mouse_wheel; }
+  bool mouse_down() const { return current.buttons & 1; }
+  bool mouse_pressed() const { return current.buttons & ~previous.buttons & 1; }
+  // True if nothing is pressed and the mouse didn't move since the previous frame
+  bool idle() const {
+    return current.keys == 0 && current.buttons == 0 && current.mouse_wheel == 0 &&
+      current.mouse_x == previous.mouse_x && current.mouse_y == previous.mouse_y;
+  }
+
+  bool key_down(const int key) const {
+    for (int i = 0; i < KEY_COUNT; i++) {
+      if (KEYS[i] == key) return current.keys & (1u << i);
+    }
+    return false;
+  }
+  bool key_pressed(const int key) const {
+    for (int i = 0; i < KEY_COUNT; i++) {
+      if (KEYS[i] == key) return (current.keys & ~previous.keys) & (1u << i);
+    }
+    return false;
+  }
+};
+
+// Draggable handles registered by the UI components every frame. Every handle is a circle in world coordinates.
+// Handles are put into a uniform grid of cells which is stored as a hash table, so finding 
+// the handle under the mouse checks only the handles of a single cell, however many handles there are. 
+// The grid is kept between frames. A handle which is registered again at the same place doesn't
+// change it, only added, moved and removed handles are put into or taken out of their cells.
+struct handle_registry {
+  struct handle {
+    uint32_t id = 0;
+    vec2 position = vec2(0, 0);
+    float radius = 0;
+    // Position in the registration order of the frame, the handle registered last is on top
+    uint32_t order = 0;
+    // Frame in which the handle was registered last time
+    uint32_t frame = 0;
+    bool large = false;
+  };
+  // Handles which cover more cells than that are checked on every hit test instead
+  static const int MAX_HANDLE_CELLS = 16;
+
+  float cell_size = 64;
+  std::vector<handle> handles;
+  // Index of the handle with the given id in handles
+  std::unordered_map<uint32_t, uint32_t> indices;
+  // Indices of the handles which cover a cell of the bucket, the number of buckets is a power of two
+  std::vector<std::vector<uint32_t>> buckets = std::vector<std::vector<uint32_t>>(64);
+  std::vector<uint32_t> large_handles;
+  uint32_t frame = 1;
+  uint32_t registered = 0;
+
+  // Registers the handle for the current frame
+  void add(const uint32_t id, const vec2& position, const float radius) {
+    const auto found = indices.find(id);
+    uint32_t i;
+    if (found == indices.end()) {
+      i = (uint32_t) handles.size();
+      handles.push_back(handle{id, position, radius});
+      indices[id] = i;
+      if (handles.size() * 2 > buckets.size()) rehash(buckets.size() * 2);
+      else link(i);
+    } else {
+      i = found->second;
+      handle& h = handles[i];
+      if (h.position != position || h.radius != radius) {
+        unlink(i);
+        h.position = position;
+        h.radius = radius;
+        link(i);
+      }
+    }
+    handles[i].order = registered++;
+    handles[i].frame = frame;
+  }
+
+  // Removes the handles which were not registered during the frame and starts the next one
+  void end_frame() {
+    if (registered != handles.size()) {
+      for (size_t i = handles.size(); i-- > 0;) {
+        if (handles[i].frame != frame) remove((uint32_t) i);
+      }
+    }
+    frame++;
+    registered = 0;
+  }
+
+  ivec2 cell(const vec2& position) const { return ivec2(floor(position / cell_size)); }
+
+  uint32_t bucket(const ivec2& cell) const {
+    const uint32_t hash = uint32_t(cell.x) * 73856093u ^ uint32_t(cell.y) * 19349663u;
+    return hash & uint32_t(buckets.size() - 1);
+  }
+
+  // Calls f(bucket) for every cell covered by the bounding box of the handle
+  template <typename F>
+  void for_each_bucket(const handle& h, F f) const {
+    const ivec2 lower = cell(h.position - h.radius);
+    const ivec2 upper = cell(h.position + h.radius);
+    for (int y = lower.y; y <= upper.y; y++) 
+      for (int x = lower.x; x <= upper.x; x++) f(bucket(ivec2(x, y)));
+  }
 
-// Defines a 2D camera which can be scaled, moved around and rotated.
-// There are 2 type of coordinates: world coordinates and display coordinates.
-// World coordinates are coordinates in which we define all vectors for calculations (millimeters).
-// Display coordinates are coordinates which describe where on the screen objects are rendered (pixels).
-struct view {
+  bool is_large(const handle& h) const {
+    const ivec2 cells = cell(h.position + h.radius) - cell(h.position - h.radius) + 1;
+    return cells.x * cells.y > MAX_HANDLE_CELLS;
+  }
 
-  mat3 view = glm::translate(glm::scale(mat3(1.), vec2(1, -1)), vec2(WINDOW_WIDTH / 2, -WINDOW_HEIGHT / 2));
-  void translate(const vec2& vec) { view = glm::translate(view, vec); }
-  void scale(const float& value) { view = glm::scale(view, vec2(value, value)); }
+  void link(const uint32_t i) {
+    handle& h = handles[i];
+    h.large = is_large(h);
+    if (h.large) large_handles.push_back(i);
+    else for_each_bucket(h, [&](const uint32_t b) { buckets[b].push_back(i); });
+  }
 
-  // From world size to display size
-  float transform(const float value) const {
-    const vec3 v = view * vec3(value, 0, 0);
-    return length(v);
+  // Order inside of the lists doesn't matter, so entries are removed by swapping with the last one
+  static void erase(std::vector<uint32_t>& list, const uint32_t i) {
+    for (uint32_t& entry : list) {
+      if (entry != i) continue;
+      entry = list.back();
+      list.pop_back();
+      return;
+    }
   }
 
-  // From display size to world size
-  float inverse_transform(const float value) const {
-    const vec3 v = inverse(view) * vec3(value, 0, 0);
-    return length(v);
+  void unlink(const uint32_t i) {
+    const handle& h = handles[i];
+    if (h.large) erase(large_handles, i);
+    else for_each_bucket(h, [&](const uint32_t b) { erase(buckets[b], i); });
   }
 
-  // From display coordinates to world coordinates
-  vec2 inverse_transform(const Vector2& vector) const {
-    const vec3 v = inverse(view) * vec3(vector.x, vector.y, 1.f);
-    return vec2{v.x, v.y};
+  // The last handle takes the place of the removed one
+  void remove(const uint32_t i) {
+    const uint32_t last = (uint32_t) handles.size() - 1;
+    unlink(i);
+    indices.erase(handles[i].id);
+    if (i != last) {
+      unlink(last);
+      handles[i] = handles[last];
+      indices[handles[i].id] = i;
+      link(i);
+    }
+    handles.pop_back();
   }
 
-  // From world coordinates to display coordinates
-  Vector2 transform(const vec2& vector) const {
-    const vec3 v = view * vec3(vector, 1.f);
-    return Vector2{v.x, v.y};
+  void rehash(const size_t bucket_count) {
+    buckets.assign(bucket_count, std::vector<uint32_t>());
+    large_handles.clear();
+    for (uint32_t i = 0; i < handles.size(); i++) link(i);
   }
 
+  // Returns the id of the handle at the given position or 0 if there is none.
+  // If handles overlap, the one registered last is on top, because it was drawn last.
+  uint32_t hit_test(const vec2& position) const {
+    const handle* top = nullptr;
+    const auto test = [&](const uint32_t i) {
+      const handle& h = handles[i];
+      if ((!top || h.order > top->order) && length(position - h.position) < h.radius) top = &h;
+    };
+    for (const uint32_t i : buckets[bucket(cell(position))]) test(i);
+    for (const uint32_t i : large_handles) test(i);
+    return top ? top->id : 0;
+  }
 };
 
 // Describes the state of the UI components
 struct interface {
-  enum class component {
+  enum class component : uint32_t {
     NONE,
     CYLINDER_GUIDE_DIRECTION,
-    CYLINDER_GUIDE_POSITION
+    CYLINDER_GUIDE_POSITION,
+    PLOT_SIGNAL,
+    PLOT_WINDOW
   };
 
+  // Identifies the handle of a component of a scene object, 0 is no handle
+  using handle_id = uint32_t;
+  static handle_id handle(const component c, const uint32_t object = 0) { return object << 8 | uint32_t(c); }
+
+  ::input input;
   MouseCursor cursor = MOUSE_CURSOR_DEFAULT;
   bool show_cylinder_guides = true;
+  // Simulation is paused, the engine can still be changed with the guides
+  bool paused = false;
+  // While paused, number of simulation steps back in the history which are shown
+  size_t history_offset = 0;
+  // Number of frames the scrubbing key is held, scrubbing speeds up with it
+  int scrub_frames = 0;
+  // Plot panel with the signals which are shown and the time it covers in seconds
+  bool show_plot = false;
+  bool plot_signals[plot_history::SIGNAL_COUNT] = { true, true, false };
+  float plot_window = 10;
   // When we're dragging something on the screen, we don't want to accidentally
   // trigger other UI components when mouse cursor goes through them.
-  // For that, we define an active component. If there is an active component set,
+  // For that, we define an active handle. If there is an active handle set,
   // other UI components will basically ignore any mouse inputs.
-  // As soon as mouse released, the active component is reset.
-  component active_component = component::NONE;
+  // As soon as mouse released, the active handle is reset.
+  handle_id active_handle = 0;
+  // Handle under the mouse found at the end of the previous frame
+  handle_id hovered_handle = 0;
+  handle_registry handles;
+
+  // Registers a handle for the current frame and returns true if the mouse is over it
+  bool add_handle(const handle_id id, const vec2& position, const float radius) {
+    handles.add(id, position, radius);
+    return hovered_handle == id;
+  }
 
-  // Set an active component only if no component is active
-  void set_active(component c) {
-    if (active_component == component::NONE)
-      active_component = c;
+  // Finds the handle under the mouse (in world coordinates) among the handles registered
+  // during the frame. Components get the result on the next frame when they register their handles again.
+  void update_handles(const vec2& mouse_position) {
+    handles.end_frame();
+    hovered_handle = handles.hit_test(mouse_position);
   }
 
-  bool is_active(component c) {
-    return active_component == c;
+  // Set an active handle only if no handle is active
+  void set_active(handle_id h) {
+    if (active_handle == 0)
+      active_handle = h;
   }
 
-  void set_cursor(component c, MouseCursor cursor) {
-    if (active_component == component::NONE || active_component == c)
+  bool is_active(handle_id h) {
+    return active_handle == h;
+  }
+
+  void set_cursor(handle_id h, MouseCursor cursor) {
+    if (active_handle == 0 || active_handle == h)
       this->cursor = cursor;
   }
 };
@@ -173,17 +3721,124 @@ void draw_cylinder_guides(interface& interface, const view&, engine&);
 void draw_crankshaft(const view&, const engine&);
 void draw_connecting_rod(const view& view, const engine&);
 void draw_piston(const view&, const engine&);
+void draw_motion_blur(const view&, const engine&, const motion_blur&);
+void draw_trails(const view&, const trails&, const history&, size_t history_offset);
+void draw_plot(interface&, const plot_history&);
+void draw_trace_status(const trace_writer&);
+#ifdef PISTON_PROFILER
+void draw_profiler_overlay(const profiler&);
+#endif
+
+// Command line tools which run without a window
+float option(int argc, char** argv, const char* name, float fallback);
+const char* text_option(int argc, char** argv, const char* name, const char* fallback);
+int run_optimizer(int argc, char** argv);
+int run_tolerance_analysis(int argc, char** argv);
+int run_certifier(int argc, char** argv);
+int run_trace(int argc, char** argv);
+int run_inspect(int argc, char** argv);
+int run_compress(int argc, char** argv);
+int run_decompress(int argc, char** argv);
+int run_benchmark(int argc, char** argv);
+int run_clearance(int argc, char** argv);
+int run_valves(int argc, char** argv);
+int run_linkage(int argc, char** argv);
+int run_fixed(int argc, char** argv);
+int run_presets(int argc, char** argv);
 
 // ================= MAIN IMPLEMENTATION ==================
 
-int main() {
+int main(int argc, char** argv) {
+  // Usage: piston [command] --profile-trace profile.json
+  // Streams profiler events of any command into a Chrome Trace Event file
+  const char* profile_path = text_option(argc, argv, "profile-trace", nullptr);
+#ifdef PISTON_PROFILER
+  if (profile_path && !trace_export::instance().open(profile_path)) {
+    printf("Can't open %s\n", profile_path);
+    return 1;
+  }
+  // Writes the remaining events when main() returns
+  struct trace_export_close { ~trace_export_close() { trace_export::instance().close(); } } trace_export_close;
+#else
+  if (profile_path) printf("Compile with -DPISTON_PROFILER to record profiles\n");
+#endif
+
+  if (argc > 1 && strcmp(argv[1], "optimize") == 0) return run_optimizer(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "tolerance") == 0) return run_tolerance_analysis(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "certify") == 0) return run_certifier(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "trace") == 0) return run_trace(argc, argv);
+  if (argc > 2 && strcmp(argv[1], "inspect") == 0) return run_inspect(argc, argv);
+  if (argc > 3 && strcmp(argv[1], "compress") == 0) return run_compress(argc, argv);
+  if (argc > 3 && strcmp(argv[1], "decompress") == 0) return run_decompress(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) return run_benchmark(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "clearance") == 0) return run_clearance(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "valves") == 0) return run_valves(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "linkage") == 0) return run_linkage(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "fixed") == 0) return run_fixed(argc, argv);
+  if (argc > 1 && strcmp(argv[1], "presets") == 0) return run_presets(argc, argv);
+
   engine engine;
   view view;
   interface interface;
+  scene_layers layers;
+
+  // Usage: piston [--record motion.trace]
+  // Records the state of the engine at every frame into the binary trace
+  trace_writer trace;
+  const char* trace_path = text_option(argc, argv, "record", nullptr);
+  if (trace_path && !trace.open(trace_path)) {
+    printf("Can't open %s\n", trace_path);
+    return 1;
+  }
+
+  // Usage: piston [--record-input session.input | --replay-input session.input]
+  // Replay runs as fast as possible with the recorded frame time and reports frame times at the end
+  const char* record_input_path = text_option(argc, argv, "record-input", nullptr);
+  const char* replay_input_path = text_option(argc, argv, "replay-input", nullptr);
+  const bool replay = replay_input_path != nullptr;
+  if ((record_input_path && !interface.input.open(record_input_path, input::mode::RECORD)) ||
+      (replay && !interface.input.open(replay_input_path, input::mode::REPLAY))) {
+    printf("Can't open %s\n", replay ? replay_input_path : record_input_path);
+    return 1;
+  }
+  std::vector<float> frame_times;
+
+  // Usage: piston [--history-budget 8 (MB)]
+  history history;
+  history.set_budget((size_t) (option(argc, argv, "history-budget", 8) * 1024 * 1024));
+  // Usage: piston [--plot-samples 262144]
+  // Number of steps which can be plotted, the plot panel is toggled with P
+  plot_history plot;
+  plot.set_capacity((size_t) option(argc, argv, "plot-samples", 262144));
+  float simulation_time = 0;
+  // Crank angle written to the trace, it doesn't wrap around
+  double recorded_angle = 0;
+
+  // Usage: piston [--rpm 30] [--motion-blur 32]
+  // Motion blur draws at least the given number of positions per frame and is toggled with M
+  const float angular_velocity = option(argc, argv, "rpm", 0.05f / 0.016f * 60 / (2 * pi<float>())) * 2 * pi<float>() / 60;
+  motion_blur motion_blur;
+  motion_blur.samples = std::max(1, (int) option(argc, argv, "motion-blur", motion_blur.samples));
+  motion_blur.enabled = text_option(argc, argv, "motion-blur", nullptr) != nullptr;
+
+  // Usage: piston [--trail 600 (steps)] [--trail-points 0,0.5,1]
+  // Trails of the points on the connecting rod are toggled with T
+  trails trails;
+  trails.length = std::max(2, (int) option(argc, argv, "trail", trails.length));
+  trails.enabled = text_option(argc, argv, "trail", nullptr) != nullptr;
+  if (const char* points = text_option(argc, argv, "trail-points", nullptr)) {
+    trails.rod_points.clear();
+    for (char* end = nullptr; ; points = end + 1) {
+      const float t = strtof(points, &end);
+      if (end == points) break;
+      trails.rod_points.push_back(t);
+      if (*end != ',') break;
+    }
+  }
 
   SetConfigFlags(FLAG_MSAA_4X_HINT | FLAG_WINDOW_ALWAYS_RUN | FLAG_WINDOW_HIGHDPI);
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Piston");
-  SetTargetFPS(TARGET_FPS);
+  SetTargetFPS(replay ? 0 : TARGET_FPS);
 
   // Smooth zoom
   float zoom_speed = 0;
@@ -195,29 +3850,100 @@ int main() {
   float camera_dumping = 0.8f;
 
   while (!WindowShouldClose()) {
+    const auto frame_start = std::chrono::steady_clock::now();
+    PROFILE_FRAME();
+    interface.input.update();
+    if (interface.input.finished) break;
+
     BeginDrawing();
     ClearBackground(RAYWHITE);
 
     // === UPDATE ==
-    const float delta = GetFrameTime() / 0.016f;
-    engine.crankshaft.angle += 0.05 * delta;
-    engine.calculate_positions();
+    PROFILE_STAGE(UPDATE);
+    // After waiting for events the frame time includes the whole wait, so it's limited
+    // to keep the first frame after idle from jumping
+    const float delta = std::min(interface.input.frame_time(), 0.1f) / 0.016f;
+    const float frame_start_angle = engine.crankshaft.angle;
+    // Angle the crankshaft turned during the frame. A frame which starts from or shows a state 
+    // of the history jumps there, which is not a motion and isn't blurred.
+    float frame_sweep = 0;
+    bool jumped = interface.history_offset > 0;
+    if (interface.input.key_pressed(KEY_SPACE)) interface.paused = !interface.paused;
+    if (interface.input.key_pressed(KEY_M)) motion_blur.enabled = !motion_blur.enabled;
+    if (interface.input.key_pressed(KEY_T)) trails.enabled = !trails.enabled;
+    if (interface.input.key_pressed(KEY_P)) interface.show_plot = !interface.show_plot;
+    if (interface.paused) {
+      // Scrubbing through the history
+      const bool back = interface.input.key_down(KEY_LEFT);
+      const bool forward = interface.input.key_down(KEY_RIGHT);
+      interface.scrub_frames = back || forward ? interface.scrub_frames + 1 : 0;
+      const size_t steps = 1 + interface.scrub_frames / 10;
+      if (back) interface.history_offset = std::min(interface.history_offset + steps, std::max<size_t>(history.size(), 1) - 1);
+      if (forward) interface.history_offset -= std::min(interface.history_offset, steps);
+    } else {
+      // Simulation continues from the shown state, the states after it are forgotten.
+      // The recorded angle moves forward to the same position within a turn, so the trace keeps increasing.
+      if (interface.history_offset > 0) {
+        const double turn = 2 * pi<double>();
+        recorded_angle += fmod(fmod(engine.crankshaft.angle - recorded_angle, turn) + turn, turn);
+      }
+      history.drop(interface.history_offset);
+      plot.drop(interface.history_offset);
+      interface.history_offset = 0;
+      // Simulation runs with the fixed step, so the history has the same time between states
+      simulation_time += std::min(interface.input.frame_time(), 0.1f);
+      for (; simulation_time >= SIMULATION_STEP; simulation_time -= SIMULATION_STEP) {
+        // The angle is kept within a turn, a growing float loses precision in minutes at high speed.
+        // Recorded angles keep growing, readers of traces expect them to increase.
+        engine.crankshaft.angle = fmod(engine.crankshaft.angle + angular_velocity * SIMULATION_STEP, 2 * pi<float>());
+        recorded_angle += angular_velocity * SIMULATION_STEP;
+        frame_sweep += angular_velocity * SIMULATION_STEP;
+        engine.calculate_positions();
+        history.push(engine);
+        plot.push(engine);
+        if (trace_path) 
+          trace.write((float) recorded_angle, engine.crankshaft.crankpin_position, engine.piston.position, engine.piston.exists);
+      }
+    }
+    if (interface.history_offset > 0) {
+      history.restore(interface.history_offset, engine);
+      jumped = true;
+    } else {
+      engine.calculate_positions();
+    }
+    const bool blur = motion_blur.enabled && frame_sweep != 0 && !jumped;
+    if (blur) motion_blur.update(engine, frame_start_angle, frame_sweep);
 
     // === RENDER ==
-    draw_coordinates(view);
-    draw_crankshaft(view, engine);
-    if (engine.piston.exists) {
-      draw_connecting_rod(view, engine);
-      draw_piston(view, engine);
+    PROFILE_STAGE(RENDER);
+    // Coordinates only change with the view
+    layers.coordinates.draw(view.view, [&]() { draw_coordinates(view); });
+    if (trails.enabled)
+      draw_trails(view, trails, history, interface.history_offset);
+    if (blur) {
+      draw_motion_blur(view, engine, motion_blur);
+    } else {
+      draw_crankshaft(view, engine);
+      if (engine.piston.exists) {
+        draw_connecting_rod(view, engine);
+        draw_piston(view, engine);
+      }
     }
     if (interface.show_cylinder_guides)
       draw_cylinder_guides(interface, view, engine);
+    if (trace_path)
+      draw_trace_status(trace);
+    if (interface.show_plot)
+      draw_plot(interface, plot);
+    if (interface.paused)
+      DrawText(TextFormat("PAUSED %.2f s", -(float) interface.history_offset * SIMULATION_STEP), 10, WINDOW_HEIGHT - 20, 10, DARKGRAY);
 
-    // Reset the active component if the mouse was released
-    if (IsMouseButtonUp(MOUSE_BUTTON_LEFT))
-      interface.active_component = interface::component::NONE;
+    // Reset the active handle if the mouse was released
+    if (!interface.input.mouse_down())
+      interface.active_handle = 0;
 
     // === CONTROL ===
+    PROFILE_STAGE(CONTROL);
     // Smooth zoom control
     zoom_speed = zoom_speed * (zoom_dump * delta);
     if (is_zero(abs(zoom_speed))) zoom_speed = 0;
@@ -227,29 +3953,754 @@ int main() {
 
     // View control
     const float camera_move_speed = 1 / view.transform(1);
-    if (IsKeyDown(KEY_W)) camera_speed += vec2(0, -camera_move_speed);
-    if (IsKeyDown(KEY_S)) camera_speed += vec2(0, camera_move_speed);
-    if (IsKeyDown(KEY_A)) camera_speed += vec2(camera_move_speed, 0);
-    if (IsKeyDown(KEY_D)) camera_speed += vec2(-camera_move_speed, 0);
-    const float mouse_wheel = GetMouseWheelMove();
+    if (interface.input.key_down(KEY_W)) camera_speed += vec2(0, -camera_move_speed);
+    if (interface.input.key_down(KEY_S)) camera_speed += vec2(0, camera_move_speed);
+    if (interface.input.key_down(KEY_A)) camera_speed += vec2(camera_move_speed, 0);
+    if (interface.input.key_down(KEY_D)) camera_speed += vec2(-camera_move_speed, 0);
+    const float mouse_wheel = interface.input.mouse_wheel();
     if (mouse_wheel != 0) zoom_speed = (mouse_wheel / abs(mouse_wheel)) * zoom_max_speed;
 
     if (!is_zero(length(camera_speed))) view.translate(camera_speed * delta);
     // The second condition is to prevent the case when we zoom so much, that we invert the camera coordinates
     if (!is_zero(zoom_speed) && !(zoom_speed < 0 && view.transform(1) < 0.1f)) view.scale(1 + (zoom_speed * delta));
 
+    // Handles are hit-tested with the view of the next frame
+    interface.update_handles(view.inverse_transform(interface.input.mouse_position()));
+
+    // When nothing moves, the next frame would be the same as this one. Instead of drawing it, 
+    // EndDrawing() blocks until there is an input event. Replay has no events to wait for.
+    const bool idle = interface.paused && interface.input.idle() && interface.active_handle == 0 &&
+      zoom_speed == 0 && camera_speed == vec2(0, 0);
+    if (idle && !replay) EnableEventWaiting();
+    else DisableEventWaiting();
+
     // Update mouse cursor if set
     SetMouseCursor(interface.cursor);
     // And reset it back
     interface.cursor = MOUSE_CURSOR_DEFAULT;
 
+#ifdef PISTON_PROFILER
+    profiler& profiler = profiler::instance();
+    profiler.collect();
+    if (interface.input.key_pressed(KEY_F1)) profiler.show_overlay = !profiler.show_overlay;
+    if (profiler.show_overlay) draw_profiler_overlay(profiler);
+#endif
+
     EndDrawing();
+    // Only a replay reports frame times, a live window would grow the list forever
+    if (replay) frame_times.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
   }
 
+  layers.unload();
   CloseWindow();
+  interface.input.close();
+  if (replay && !frame_times.empty()) {
+    std::vector<float> sorted = frame_times;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (float time : sorted) total += time;
+    printf("%zu frames, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", sorted.size(), total / sorted.size(),
+      sorted[sorted.size() / 2], sorted[sorted.size() * 99 / 100], sorted.back());
+  }
+  if (trace_path) {
+    const async_file_writer::backpressure& metrics = trace.file.metrics;
+    const bool written = trace.close();
+    printf("%llu samples written to %s, %llu stalls (%.2f ms), max queue depth %d\n",
+      (unsigned long long) trace.header.sample_count, trace_path, (unsigned long long) metrics.stalls.load(),
+      metrics.stall_nanoseconds.load() / 1e6, metrics.max_queue_depth.load());
+    if (!written) return 1;
+  }
+  return 0;
+}
+
+// Returns the value of the "--name value" command line option
+float option(int argc, char** argv, const char* name, float fallback) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, name) == 0)
+      return atof(argv[i + 1]);
+  }
+  return fallback;
+}
+
+// Usage: piston optimize --stroke 86 --max-rod-angle 16 [--starts 64] [--seed 1] [--max-rod-length L]
+// The longest connecting rod which is searched defaults to stroke / sin(max rod angle). That is twice
+// the rod of the geometry without offset and with the crank radius of half the stroke, which already 
+// satisfies the angle constraint, and a longer rod only moves the piston further away.
+int run_optimizer(int argc, char** argv) {
+  geometry_optimizer optimizer;
+  optimizer.target_stroke = option(argc, argv, "stroke", optimizer.target_stroke);
+  optimizer.max_rod_angle = radians(option(argc, argv, "max-rod-angle", degrees(optimizer.max_rod_angle)));
+  optimizer.starts = (int) option(argc, argv, "starts", optimizer.starts);
+  optimizer.seed = (uint64_t) option(argc, argv, "seed", optimizer.seed);
+  optimizer.upper.crank_radius = optimizer.target_stroke;
+  optimizer.upper.connecting_rod_length = option(argc, argv, "max-rod-length", 
+    optimizer.target_stroke / sin(std::max(optimizer.max_rod_angle, radians(0.1f))));
+  optimizer.lower.offset = -optimizer.target_stroke / 2;
+  optimizer.upper.offset = optimizer.target_stroke / 2;
+
+  const auto start = std::chrono::steady_clock::now();
+  const geometry_optimizer::result result = optimizer.optimize();
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+  if (!result.feasible) {
+    printf("No geometry satisfies the constraints with connecting rods up to %.1f (--max-rod-length)\n", 
+      optimizer.upper.connecting_rod_length);
+    return 1;
+  }
+  const geometry& g = result.design;
+  printf("crank_radius:          %.3f\n", g.crank_radius);
+  printf("connecting_rod_length: %.3f\n", g.connecting_rod_length);
+  printf("cylinder offset:       %.3f\n", g.offset);
+  printf("stroke:                %.3f\n", g.stroke());
+  printf("max rod angle:         %.3f deg\n", degrees(g.max_rod_angle()));
+  printf("TDC distance:          %.3f\n", g.top_dead_center());
+  printf("%d starts, %.2f ms total, %.3f ms per start\n", 
+    optimizer.starts, elapsed.count(), elapsed.count() / optimizer.starts);
+  return 0;
+}
+
+// Usage: piston tolerance [--samples 1e8] [--threads N] [--seed 1]
+//   [--crank-radius 50] [--rod-length 100] [--offset 0] [--clearance 1]
+//   [--crank-radius-tolerance 0.05] [--rod-length-tolerance 0.1] 
+//   [--offset-tolerance 0.1] [--cylinder-angle-tolerance 0.05 (degrees)]
+int run_tolerance_analysis(int argc, char** argv) {
+  tolerance_analysis analysis;
+  geometry& nominal = analysis.nominal;
+  nominal.crank_radius = option(argc, argv, "crank-radius", nominal.crank_radius);
+  nominal.connecting_rod_length = option(argc, argv, "rod-length", nominal.connecting_rod_length);
+  nominal.offset = option(argc, argv, "offset", nominal.offset);
+  analysis.clearance = option(argc, argv, "clearance", analysis.clearance);
+  analysis.crank_radius_tolerance = option(argc, argv, "crank-radius-tolerance", analysis.crank_radius_tolerance);
+  analysis.connecting_rod_length_tolerance = option(argc, argv, "rod-length-tolerance", analysis.connecting_rod_length_tolerance);
+  analysis.offset_tolerance = option(argc, argv, "offset-tolerance", analysis.offset_tolerance);
+  analysis.cylinder_angle_tolerance = 
+    radians(option(argc, argv, "cylinder-angle-tolerance", degrees(analysis.cylinder_angle_tolerance)));
+  analysis.samples = (uint64_t) option(argc, argv, "samples", analysis.samples);
+  analysis.seed = (uint64_t) option(argc, argv, "seed", analysis.seed);
+  analysis.threads = (int) option(argc, argv, "threads", analysis.threads);
+  if (!nominal.valid()) {
+    printf("Connecting rod doesn't reach the cylinder with the nominal geometry\n");
+    return 1;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const tolerance_analysis::result result = analysis.run();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  const char* names[tolerance_analysis::OUTPUT_COUNT] = { "stroke", "TDC position", "clearance" };
+  printf("%-14s %12s %12s %12s %12s %12s %12s\n", "", "mean", "std dev", "min", "0.135%", "median", "99.865%");
+  for (int o = 0; o < tolerance_analysis::OUTPUT_COUNT; o++) {
+    const statistics& s = result.moments[o];
+    const histogram& h = result.histograms[o];
+    printf("%-14s %12.5f %12.5f %12.5f %12.5f %12.5f %12.5f\n", names[o], 
+      s.mean, sqrt(s.variance()), s.min, h.quantile(0.00135), h.quantile(0.5), h.quantile(0.99865));
+  }
+  printf("%llu samples (%llu invalid) in %.2f s, %.1f M samples/s\n", 
+    (unsigned long long) analysis.samples, (unsigned long long) result.invalid, 
+    elapsed.count(), analysis.samples / elapsed.count() / 1e6);
+  return 0;
+}
+
+// Returns both values of the "--name lower upper" command line option
+void range_option(int argc, char** argv, const char* name, float& lower, float& upper) {
+  for (int i = 1; i + 2 < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, name) == 0) {
+      lower = atof(argv[i + 1]);
+      upper = atof(argv[i + 2]);
+      return;
+    }
+  }
+}
+
+// Usage: piston certify [--crank-radius 20 80] [--rod-length 40 200] [--origin-x -50 50] [--origin-y -50 50]
+//   [--angle 0 360 (degrees)] [--direction-x 0] [--direction-y 1] [--depth 24]
+int run_certifier(int argc, char** argv) {
+  validity_certifier certifier;
+  certifier.direction.x = option(argc, argv, "direction-x", certifier.direction.x);
+  certifier.direction.y = option(argc, argv, "direction-y", certifier.direction.y);
+  certifier.max_depth = (int) option(argc, argv, "depth", certifier.max_depth);
+
+  const char* names[validity_certifier::DIMENSION_COUNT] = { "crank-radius", "rod-length", "origin-x", "origin-y", "angle" };
+  float lower[validity_certifier::DIMENSION_COUNT] = { 20, 40, -50, -50, 0 };
+  float upper[validity_certifier::DIMENSION_COUNT] = { 80, 200, 50, 50, 360 };
+  validity_certifier::box root;
+  for (int i = 0; i < validity_certifier::DIMENSION_COUNT; i++) {
+    range_option(argc, argv, names[i], lower[i], upper[i]);
+    root.dimensions[i] = interval(lower[i], upper[i]);
+  }
+  root.dimensions[validity_certifier::ANGLE] = interval(radians(lower[4]), radians(upper[4]));
+
+  // Volume of the box relative to the root box
+  const auto volume = [&](const validity_certifier::box& box) {
+    double result = 1;
+    for (int i = 0; i < validity_certifier::DIMENSION_COUNT; i++) {
+      if (root.dimensions[i].width() > 0) result *= box.dimensions[i].width() / root.dimensions[i].width();
+    }
+    return result;
+  };
+
+  double valid = 0, invalid = 0, undecided = 0;
+  uint64_t leaves = 0;
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t evaluated = certifier.sweep(root, [&](const validity_certifier::box& box, validity_certifier::validity v) {
+    leaves++;
+    if (v == validity_certifier::validity::VALID) valid += volume(box);
+    else if (v == validity_certifier::validity::INVALID) invalid += volume(box);
+    else undecided += volume(box);
+  });
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+  printf("valid:     %8.4f%%\n", valid * 100);
+  printf("invalid:   %8.4f%%\n", invalid * 100);
+  printf("undecided: %8.4f%%\n", undecided * 100);
+  printf("%llu boxes evaluated, %llu leaves, %.2f ms\n", 
+    (unsigned long long) evaluated, (unsigned long long) leaves, elapsed.count());
+  return 0;
+}
+
+// Returns the text of the "--name value" command line option
+const char* text_option(int argc, char** argv, const char* name, const char* fallback) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, name) == 0)
+      return argv[i + 1];
+  }
+  return fallback;
+}
+
+// Writes samples as CSV to the file or to stdout if the path is not set
+bool write_csv_trace(const char* path, const std::vector<adaptive_sampler::sample>& samples) {
+  FILE* file = path ? fopen(path, "w") : stdout;
+  if (!file) {
+    printf("Can't open %s\n", path);
+    return false;
+  }
+  fprintf(file, "angle,crankpin_x,crankpin_y,piston_x,piston_y,exists\n");
+  for (const adaptive_sampler::sample& s : samples) {
+    fprintf(file, "%.7g,%.7g,%.7g,%.7g,%.7g,%d\n", s.angle, 
+      s.crankpin_position.x, s.crankpin_position.y, s.piston_position.x, s.piston_position.y, s.exists);
+  }
+  if (path) fclose(file);
+  return true;
+}
+
+// Usage: piston trace [--output trace.csv] [--format csv|binary] [--position-tolerance 0.01] [--velocity-tolerance 0]
+//   [--from 0] [--to 360 (degrees)] [--crank-radius 50] [--rod-length 100]
+int run_trace(int argc, char** argv) {
+  engine engine;
+  engine.crankshaft.crank_radius = option(argc, argv, "crank-radius", engine.crankshaft.crank_radius);
+  engine.connecting_rod_length = option(argc, argv, "rod-length", engine.connecting_rod_length);
+
+  adaptive_sampler sampler;
+  sampler.position_tolerance = option(argc, argv, "position-tolerance", sampler.position_tolerance);
+  sampler.velocity_tolerance = option(argc, argv, "velocity-tolerance", sampler.velocity_tolerance);
+  const float from = radians(option(argc, argv, "from", 0));
+  const float to = radians(option(argc, argv, "to", 360));
+  const std::vector<adaptive_sampler::sample> samples = sampler.run(engine, from, to);
+
+  const char* path = text_option(argc, argv, "output", nullptr);
+  if (path && strcmp(text_option(argc, argv, "format", "csv"), "binary") == 0) {
+    trace_writer writer;
+    if (!writer.open(path)) {
+      printf("Can't open %s\n", path);
+      return 1;
+    }
+    for (const adaptive_sampler::sample& s : samples) 
+      writer.write(s.angle, s.crankpin_position, s.piston_position, s.exists);
+    // Failed writes of the blocks are reported by close()
+    if (!writer.close()) {
+      printf("Can't write %s\n", path);
+      return 1;
+    }
+  } else {
+    if (!write_csv_trace(path, samples)) return 1;
+  }
+
+  // Report goes to stderr, so it doesn't mix with the trace written to stdout
+  const double uniform = ceil((to - from) / sampler.smallest_step) + 1;
+  fprintf(stderr, "%zu adaptive samples, %.0f uniform samples for the same tolerance (%.1fx fewer)\n",
+    samples.size(), uniform, uniform / samples.size());
+  return 0;
+}
+
+// Usage: piston inspect <file> [--from 0] [--to 360 (degrees)]
+// Prints samples of the binary trace in the given range of angles
+int run_inspect(int argc, char** argv) {
+  trace_reader reader;
+  if (!reader.open(argv[2])) {
+    printf("%s is not a valid trace file: %s\n", argv[2], reader.error);
+    return 1;
+  }
+  printf("%llu samples, %u samples per block, %u columns:", 
+    (unsigned long long) reader.sample_count(), reader.header.block_size, reader.header.column_count);
+  for (uint32_t c = 0; c < reader.header.column_count; c++) printf(" %s", reader.header.columns[c].name);
+  printf("\n");
+
+  const uint64_t first = reader.find(radians(option(argc, argv, "from", 0)));
+  const float to = radians(option(argc, argv, "to", 360));
+  for (uint64_t i = first; i < reader.sample_count() && reader.angle(i) <= to; i++) {
+    const vec2 crankpin = reader.crankpin_position(i);
+    const vec2 piston = reader.piston_position(i);
+    printf("%.7g,%.7g,%.7g,%.7g,%.7g,%d\n", reader.angle(i), crankpin.x, crankpin.y, piston.x, piston.y, reader.exists(i));
+  }
+  reader.close();
+  return 0;
+}
+
+// Usage: piston compress <input.trace> <output.ptz> [--tolerance 0.001] [--angle-tolerance 1e-6]
+//   [--predictor previous|linear|geometry] [--crank-radius 50] [--rod-length 100]
+//   [--origin-x 0] [--origin-y 0] [--direction-x 0] [--direction-y 20]
+int run_compress(int argc, char** argv) {
+  trace_reader reader;
+  if (!reader.open(argv[2])) {
+    printf("%s is not a valid trace file: %s\n", argv[2], reader.error);
+    return 1;
+  }
+  trace_codec::columns columns;
+  for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+    columns.values[c].resize(reader.sample_count());
+    for (uint64_t i = 0; i < reader.sample_count(); i++)
+      columns.values[c][i] = c == TRACE_EXISTS ? reader.value<uint8_t>(c, i) : reader.value<float>(c, i);
+  }
+  reader.close();
+
+  trace_codec codec;
+  compressed_trace_header& header = codec.header;
+  header.tolerance = option(argc, argv, "tolerance", 0.001f);
+  header.angle_tolerance = option(argc, argv, "angle-tolerance", 1e-6f);
+  const char* predictor = text_option(argc, argv, "predictor", "geometry");
+  header.predictor = strcmp(predictor, "previous") == 0 ? trace_codec::PREVIOUS
+    : strcmp(predictor, "linear") == 0 ? trace_codec::LINEAR : trace_codec::GEOMETRY;
+  engine engine;
+  engine.get_parameters(header.parameters);
+  const char* names[engine::PARAMETER_COUNT] = { "crank-radius", "rod-length", "origin-x", "origin-y", "direction-x", "direction-y", "angle" };
+  for (int p = 0; p < engine::PARAMETER_COUNT; p++) header.parameters[p] = option(argc, argv, names[p], header.parameters[p]);
+  if (!(header.tolerance > 0 && header.tolerance < INFINITY && header.angle_tolerance > 0 && header.angle_tolerance < INFINITY)) {
+    printf("Tolerances must be positive and finite\n");
+    return 1;
+  }
+  // Quantized values and the differences between them must fit into 64-bit integers, 
+  // 1e15 steps also keeps them exact in double precision
+  for (int c = 0; c < TRACE_COLUMN_COUNT; c++) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      if (!(abs(columns.values[c][i]) / codec.step(c) < 1e15)) {
+        printf("Tolerance is too small for the values in %s\n", argv[2]);
+        return 1;
+      }
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const std::vector<uint8_t> compressed = codec.encode(columns);
+  const auto encoded = std::chrono::steady_clock::now();
+  trace_codec::columns decoded;
+  trace_codec decoder;
+  const bool valid = decoder.decode(compressed.data(), compressed.size(), decoded) && decoded.size() == columns.size();
+  const auto end = std::chrono::steady_clock::now();
+  if (!valid) {
+    printf("Compressed trace can't be decoded\n");
+    return 1;
+  }
+
+  // Every value is within the tolerance, plus rounding of the decoded value to float
+  float max_error = 0;
+  bool accurate = true;
+  for (int c = TRACE_CRANKPIN_X; c <= TRACE_PISTON_Y; c++) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      const float error = abs(columns.values[c][i] - decoded.values[c][i]);
+      max_error = max(max_error, error);
+      accurate &= error <= header.tolerance + abs(columns.values[c][i]) * FLT_EPSILON;
+    }
+  }
+  if (!accurate) {
+    printf("Max position error %g exceeds the tolerance %g\n", max_error, header.tolerance);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[3], "wb");
+  if (!file || fwrite(compressed.data(), 1, compressed.size(), file) != compressed.size()) {
+    printf("Can't write %s\n", argv[3]);
+    if (file) fclose(file);
+    return 1;
+  }
+  fclose(file);
+
+  const double raw = columns.size() * (5 * sizeof(float) + 1.);
+  const double encode_seconds = std::chrono::duration<double>(encoded - start).count();
+  const double decode_seconds = std::chrono::duration<double>(end - encoded).count();
+  printf("%zu samples, %.0f bytes -> %zu bytes (%.1fx), max position error %g\n", 
+    columns.size(), raw, compressed.size(), raw / compressed.size(), max_error);
+  printf("encode %.1f MB/s, decode %.1f MB/s\n", raw / encode_seconds / 1e6, raw / decode_seconds / 1e6);
+  return 0;
+}
+
+// Usage: piston decompress <input.ptz> <output.trace>
+int run_decompress(int, char** argv) {
+  FILE* file = fopen(argv[2], "rb");
+  if (!file) {
+    printf("Can't open %s\n", argv[2]);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[65536];
+  for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;) data.insert(data.end(), chunk, chunk + read);
+  fclose(file);
+
+  trace_codec codec;
+  trace_codec::columns columns;
+  if (!codec.decode(data.data(), data.size(), columns)) {
+    printf("%s is not a valid compressed trace\n", argv[2]);
+    return 1;
+  }
+  trace_writer writer;
+  if (!writer.open(argv[3])) {
+    printf("Can't open %s\n", argv[3]);
+    return 1;
+  }
+  for (size_t i = 0; i < columns.size(); i++) {
+    writer.write(columns.values[TRACE_ANGLE][i],
+      vec2(columns.values[TRACE_CRANKPIN_X][i], columns.values[TRACE_CRANKPIN_Y][i]),
+      vec2(columns.values[TRACE_PISTON_X][i], columns.values[TRACE_PISTON_Y][i]),
+      columns.values[TRACE_EXISTS][i] != 0);
+  }
+  return writer.close() ? 0 : 1;
+}
+
+// Usage: piston bench [--batch 4096] [--batches 1000] [--seed 1]
+// Reports costs of the kinematics kernels per element together with the hardware counters
+int run_benchmark(int argc, char** argv) {
+  kernel_benchmark benchmark;
+  benchmark.batch_size = (int) option(argc, argv, "batch", benchmark.batch_size);
+  benchmark.batches = (int) option(argc, argv, "batches", benchmark.batches);
+  benchmark.seed = (uint64_t) option(argc, argv, "seed", benchmark.seed);
+  if (benchmark.batch_size <= 0 || benchmark.batches <= 0) {
+    printf("Batch size and number of batches must be positive\n");
+    return 1;
+  }
+
+  perf_counters& counters = benchmark.counters;
+  const int opened = counters.open();
+  if (opened < perf_counters::COUNTER_COUNT) {
+    printf("%d of %d hardware counters are available", opened, perf_counters::COUNTER_COUNT);
+#ifdef PISTON_PERF_EVENTS
+    printf(" (check /proc/sys/kernel/perf_event_paranoid)");
+#endif
+    printf(", unavailable ones are shown as -\n");
+  }
+  benchmark.run();
+
+  const double elements = (double) benchmark.batch_size * benchmark.batches;
+  printf("%-20s %10s %10s %12s %8s %14s %13s\n", 
+    "per element", "ns", "cycles", "instructions", "IPC", "branch misses", "cache misses");
+  for (int k = 0; k < kernel_benchmark::KERNEL_COUNT; k++) {
+    const perf_counters::sample& sample = benchmark.samples[k];
+    printf("%-20s %10.2f", kernel_benchmark::KERNEL_NAMES[k], sample.nanoseconds / elements);
+    for (int c = 0; c < perf_counters::COUNTER_COUNT; c++) {
+      const int width[perf_counters::COUNTER_COUNT] = { 10, 12, 14, 13 };
+      if (c == perf_counters::BRANCH_MISSES) {
+        const bool ipc = counters.available(perf_counters::CYCLES) && counters.available(perf_counters::INSTRUCTIONS);
+        if (ipc) printf(" %8.2f", sample.values[perf_counters::INSTRUCTIONS] / sample.values[perf_counters::CYCLES]);
+        else printf(" %8s", "-");
+      }
+      if (counters.available((perf_counters::counter) c)) printf(" %*.3f", width[c], sample.values[c] / elements);
+      else printf(" %*s", width[c], "-");
+    }
+    printf("\n");
+  }
+  printf("%d batches of %d elements\n", benchmark.batches, benchmark.batch_size);
   return 0;
 }
 
+// Usage: piston clearance [--crank-radius 50] [--rod-length 100] [--offset 0] [--steps 3600]
+//   [--bearing-radius 10] [--crank-web-width 10] [--rod-width 10] [--piston-length 30] [--piston-width 50]
+int run_clearance(int argc, char** argv) {
+  clearance_analysis analysis;
+  geometry& design = analysis.design;
+  design.crank_radius = option(argc, argv, "crank-radius", design.crank_radius);
+  design.connecting_rod_length = option(argc, argv, "rod-length", design.connecting_rod_length);
+  design.offset = option(argc, argv, "offset", design.offset);
+  engine::part_sizes& parts = analysis.parts;
+  parts.bearing_radius = option(argc, argv, "bearing-radius", parts.bearing_radius);
+  parts.crank_web_width = option(argc, argv, "crank-web-width", parts.crank_web_width);
+  parts.connecting_rod_width = option(argc, argv, "rod-width", parts.connecting_rod_width);
+  parts.piston_length = option(argc, argv, "piston-length", parts.piston_length);
+  parts.piston_width = option(argc, argv, "piston-width", parts.piston_width);
+  analysis.steps = std::max(1, (int) option(argc, argv, "steps", analysis.steps));
+  if (!design.valid()) {
+    printf("Connecting rod doesn't reach the cylinder with this geometry\n");
+    return 1;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const clearance_analysis::result result = analysis.run();
+  const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+  bool interference = false;
+  for (int p = 0; p < clearance_analysis::PAIR_COUNT; p++) {
+    printf("%-16s %10.3f at %7.2f deg%s\n", clearance_analysis::PAIR_NAMES[p], result.clearance[p], 
+      degrees(result.angle[p]), result.clearance[p] < 0 ? "  INTERFERENCE" : "");
+    interference |= result.clearance[p] < 0;
+  }
+  printf("%d angles, %.2f ms\n", analysis.steps, elapsed.count());
+  return interference ? 2 : 0;
+}
+
+// Usage: piston valves [--crank-radius 50] [--rod-length 100] [--offset 0] [--piston-length 30] [--deck-clearance 5]
+//   [--intake-center 110] [--intake-duration 240] [--intake-lift 10] [--intake-profile 0:0,90:8,200:0]
+//   [--exhaust-center -110] [--exhaust-duration 240] [--exhaust-lift 10] [--exhaust-profile ...] [--steps 7200]
+// Angles are crank degrees from the TDC at the start of the intake stroke. 
+// Profile is a list of "angle:lift" points which replaces the polynomial lobe.
+int run_valves(int argc, char** argv) {
+  valve_train train;
+  geometry& design = train.design;
+  design.crank_radius = option(argc, argv, "crank-radius", design.crank_radius);
+  design.connecting_rod_length = option(argc, argv, "rod-length", design.connecting_rod_length);
+  design.offset = option(argc, argv, "offset", design.offset);
+  train.parts.piston_length = option(argc, argv, "piston-length", train.parts.piston_length);
+  train.deck_clearance = option(argc, argv, "deck-clearance", train.deck_clearance);
+  train.steps = std::max(2, (int) option(argc, argv, "steps", train.steps));
+  for (int v = 0; v < valve_train::VALVE_COUNT; v++) {
+    cam_lobe& lobe = train.lobes[v];
+    char name[64];
+    snprintf(name, sizeof(name), "%s-center", valve_train::VALVE_NAMES[v]);
+    lobe.center = option(argc, argv, name, lobe.center);
+    snprintf(name, sizeof(name), "%s-duration", valve_train::VALVE_NAMES[v]);
+    lobe.duration = option(argc, argv, name, lobe.duration);
+    snprintf(name, sizeof(name), "%s-lift", valve_train::VALVE_NAMES[v]);
+    lobe.max_lift = option(argc, argv, name, lobe.max_lift);
+    snprintf(name, sizeof(name), "%s-profile", valve_train::VALVE_NAMES[v]);
+    const char* profile = text_option(argc, argv, name, nullptr);
+    for (char* end = nullptr; profile; profile = *end == ',' ? end + 1 : nullptr) {
+      vec2 point;
+      point.x = strtof(profile, &end);
+      if (end == profile || *end != ':') break;
+      profile = end + 1;
+      point.y = strtof(profile, &end);
+      if (end == profile) break;
+      lobe.table.push_back(point);
+    }
+    std::sort(lobe.table.begin(), lobe.table.end(), [](const vec2& a, const vec2& b) { return a.x < b.x; });
+    if (!lobe.table.empty() && lobe.table.back().x - lobe.table.front().x > 720) {
+      printf("Profile of the %s valve spans more than 720 degrees\n", valve_train::VALVE_NAMES[v]);
+      return 1;
+    }
+  }
+  if (!design.valid()) {
+    printf("Connecting rod doesn't reach the cylinder with this geometry\n");
+    return 1;
+  }
+
+  const valve_train::result result = train.run();
+  bool interference = false;
+  printf("%-8s %10s %16s %12s %12s\n", "valve", "max lift", "max velocity", "clearance", "at");
+  for (int v = 0; v < valve_train::VALVE_COUNT; v++) {
+    printf("%-8s %10.3f %11.3f /rad %12.3f %8.1f deg%s\n", valve_train::VALVE_NAMES[v], result.max_lift[v], 
+      result.max_velocity[v], result.clearance[v], result.clearance_angle[v], result.clearance[v] < 0 ? "  INTERFERENCE" : "");
+    interference |= result.clearance[v] < 0;
+  }
+  return interference ? 2 : 0;
+}
+
+// Usage: piston linkage [--crank-radius 50] [--rod-length 100] [--offset 0] [--steps 3600] [--turns 10]
+// Solves the slider-crank as a general linkage, compares it with the closed form of calculate_positions()
+// and measures both. Returns 1 if the solutions differ.
+int run_linkage(int argc, char** argv) {
+  geometry design;
+  design.crank_radius = option(argc, argv, "crank-radius", design.crank_radius);
+  design.connecting_rod_length = option(argc, argv, "rod-length", design.connecting_rod_length);
+  design.offset = option(argc, argv, "offset", design.offset);
+  const int steps = std::max(1, (int) option(argc, argv, "steps", 3600));
+  const int turns = std::max(1, (int) option(argc, argv, "turns", 10));
+  if (!design.valid()) {
+    printf("Connecting rod doesn't reach the cylinder with this geometry\n");
+    return 1;
+  }
+  engine engine;
+  design.apply(engine);
+
+  // Initial guess is the crank along the x axis and the piston at the rod length along the cylinder
+  linkage linkage;
+  const vec2 axis = normalize(engine.cylinder.direction);
+  const int center = linkage.add_point(vec2(0, 0), true);
+  const int crankpin = linkage.add_point(vec2(design.crank_radius, 0));
+  const int piston = linkage.add_point(engine.cylinder.origin + axis * design.connecting_rod_length);
+  linkage.add_driver(crankpin, center, design.crank_radius);
+  linkage.add_distance(crankpin, piston, design.connecting_rod_length);
+  linkage.add_slider(piston, engine.cylinder.origin, engine.cylinder.direction);
+
+  // Regression against the closed form over one turn
+  uint64_t iterations = 0;
+  int failures = 0;
+  float max_error = 0;
+  for (int i = 0; i < steps; i++) {
+    linkage.angle = 2 * pi<double>() * i / steps;
+    const int used = linkage.solve();
+    if (used < 0) {
+      failures++;
+      continue;
+    }
+    iterations += used;
+    engine.crankshaft.angle = (float) linkage.angle;
+    engine.calculate_positions();
+    max_error = std::max(max_error, length(linkage.point(crankpin) - engine.crankshaft.crankpin_position));
+    max_error = std::max(max_error, length(linkage.point(piston) - engine.piston.position));
+  }
+  printf("max difference from the closed form: %.6f, %d failures, %.2f Newton iterations per step\n",
+    max_error, failures, (double) iterations / steps);
+
+  // Benchmark, the sum is printed so that the solutions are not optimized away
+  float sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < turns; t++) {
+    for (int i = 0; i < steps; i++) {
+      linkage.angle = 2 * pi<double>() * i / steps;
+      linkage.solve();
+      sum += linkage.point(piston).y;
+    }
+  }
+  const std::chrono::duration<double, std::nano> newton = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  for (int t = 0; t < turns; t++) {
+    for (int i = 0; i < steps; i++) {
+      engine.crankshaft.angle = 2 * pi<float>() * i / steps;
+      engine.calculate_positions();
+      sum += engine.piston.position.y;
+    }
+  }
+  const std::chrono::duration<double, std::nano> closed_form = std::chrono::steady_clock::now() - start;
+  const double solves = (double) steps * turns;
+  printf("warm-started Newton: %.1f ns per step, closed form: %.1f ns per step (checksum %.1f)\n",
+    newton.count() / solves, closed_form.count() / solves, sum);
+  return failures > 0 || max_error > 1e-3f ? 1 : 0;
+}
+
+// Usage: piston fixed [--crank-radius 50] [--rod-length 100] [--offset 0] [--angle-bits 20]
+// Compares the fixed-point kernel with the float path for 2^angle-bits evenly spaced angles 
+// (32 tests every angle the kernel accepts) and measures both. Returns 1 if the error bound is exceeded.
+int run_fixed(int argc, char** argv) {
+  geometry design;
+  design.crank_radius = option(argc, argv, "crank-radius", design.crank_radius);
+  design.connecting_rod_length = option(argc, argv, "rod-length", design.connecting_rod_length);
+  design.offset = option(argc, argv, "offset", design.offset);
+  const int bits = clamp((int) option(argc, argv, "angle-bits", 20), 1, 32);
+  engine engine;
+  design.apply(engine);
+  fixed_slider_crank kernel;
+  if (!kernel.prepare(engine)) {
+    printf("Cylinder has no direction\n");
+    return 1;
+  }
+
+  // Accuracy for every angle
+  const uint64_t count = 1ull << bits;
+  const int shift = 32 - bits;
+  float crankpin_error = 0, piston_error = 0;
+  uint64_t mismatches = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint32_t angle = (uint32_t) (i << shift);
+    q16 cx = 0, cy = 0, px = 0, py = 0;
+    const bool exists = kernel.solve(angle, cx, cy, px, py);
+    engine.crankshaft.angle = (float) (angle * (2 * pi<double>() / 4294967296.0));
+    engine.calculate_positions();
+    if (exists != engine.piston.exists) {
+      mismatches++;
+      continue;
+    }
+    crankpin_error = std::max(crankpin_error, length(vec2(from_q16(cx), from_q16(cy)) - engine.crankshaft.crankpin_position));
+    if (exists) piston_error = std::max(piston_error, length(vec2(from_q16(px), from_q16(py)) - engine.piston.position));
+  }
+  printf("%llu angles: max crankpin error %.6f, max piston error %.6f, %llu existence mismatches\n",
+    (unsigned long long) count, crankpin_error, piston_error, (unsigned long long) mismatches);
+
+  // Benchmark over at most 2^20 angles
+  const uint64_t samples = std::min<uint64_t>(count, 1 << 20);
+  const int sample_shift = 32 - (int) log2((double) samples);
+  int64_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < samples; i++) {
+    q16 cx = 0, cy = 0, px = 0, py = 0;
+    kernel.solve((uint32_t) (i << sample_shift), cx, cy, px, py);
+    sum += py;
+  }
+  const std::chrono::duration<double, std::nano> fixed = std::chrono::steady_clock::now() - start;
+  float float_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < samples; i++) {
+    engine.crankshaft.angle = (float) ((i << sample_shift) * (2 * pi<double>() / 4294967296.0));
+    engine.calculate_positions();
+    float_sum += engine.piston.position.y;
+  }
+  const std::chrono::duration<double, std::nano> floating = std::chrono::steady_clock::now() - start;
+  printf("fixed point: %.1f ns per solve, float: %.1f ns per solve (mean piston y %.1f and %.1f)\n", 
+    fixed.count() / samples, floating.count() / samples, from_q16((q16) (sum / (int64_t) samples)), float_sum / samples);
+
+  const bool within_bound = mismatches == 0 && crankpin_error < 0.001f && piston_error < 0.001f;
+  if (!within_bound) printf("Error bound of 0.001 exceeded\n");
+  return within_bound ? 0 : 1;
+}
+
+int run_presets(int argc, char** argv) {
+  const char* name = text_option(argc, argv, "preset", nullptr);
+  const int samples = std::max((int) option(argc, argv, "samples", 1 << 20), 1);
+  const uint64_t seed = (uint64_t) option(argc, argv, "seed", 1);
+
+  std::vector<float> angles(samples);
+  for (int i = 0; i < samples; i++) angles[i] = random_float(seed, i) * 2 * pi<float>();
+
+  bool within_bound = true;
+  bool found = false;
+  for (const preset_table_type* table : PRESETS) {
+    if (name && strcmp(name, table->preset.name) != 0) continue;
+    found = true;
+    engine exact, interpolated;
+    table->preset.apply(exact);
+    table->preset.apply(interpolated);
+
+    // Accuracy against the float path
+    float crankpin_error = 0, piston_error = 0;
+    int mismatches = 0;
+    for (const float angle : angles) {
+      exact.crankshaft.angle = interpolated.crankshaft.angle = angle;
+      exact.calculate_positions();
+      table->calculate_positions(interpolated);
+      if (exact.piston.exists != interpolated.piston.exists) {
+        mismatches++;
+        continue;
+      }
+      crankpin_error = std::max(crankpin_error, length(exact.crankshaft.crankpin_position - interpolated.crankshaft.crankpin_position));
+      if (exact.piston.exists) piston_error = std::max(piston_error, length(exact.piston.position - interpolated.piston.position));
+    }
+
+    float exact_sum = 0, interpolated_sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const float angle : angles) {
+      exact.crankshaft.angle = angle;
+      exact.calculate_positions();
+      exact_sum += length(exact.piston.position);
+    }
+    const std::chrono::duration<double, std::nano> solved = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (const float angle : angles) {
+      interpolated.crankshaft.angle = angle;
+      table->calculate_positions(interpolated);
+      interpolated_sum += length(interpolated.piston.position);
+    }
+    const std::chrono::duration<double, std::nano> table_read = std::chrono::steady_clock::now() - start;
+
+    printf("%s: max crankpin error %.6f, max piston error %.6f, %d existence mismatches\n", 
+      table->preset.name, crankpin_error, piston_error, mismatches);
+    printf("  table: %.1f ns, solver: %.1f ns per angle (mean piston distance %.1f and %.1f)\n",
+      table_read.count() / samples, solved.count() / samples, interpolated_sum / samples, exact_sum / samples);
+    if (mismatches > 0 || crankpin_error > 0.001f || piston_error > 0.001f) {
+      printf("  Error bound of 0.001 exceeded\n");
+      within_bound = false;
+    }
+  }
+  if (!found) {
+    printf("Unknown preset %s\n", name);
+    return 1;
+  }
+  return within_bound ? 0 : 1;
+}
 
 void draw_rectangle(const view& view, const vec2& start, const vec2& end, const float width, const Color& color) {
   const vec2 direction = end - start;
@@ -284,7 +4735,57 @@ void draw_arrow(const view& view, const vec2& start, const vec2& end,
   );
 }
 
+// Points of the unit circle for the largest number of segments. Circles with fewer segments
+// use every n-th point, so no circle needs to call cos or sin.
+struct unit_circle {
+  static const int MAX_SEGMENTS = 512;
+  vec2 points[MAX_SEGMENTS];
+
+  static const unit_circle& instance() {
+    static const unit_circle circle;
+    return circle;
+  }
+
+  unit_circle() {
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+      const float angle = 2 * pi<float>() * i / MAX_SEGMENTS;
+      points[i] = vec2(cos(angle), sin(angle));
+    }
+  }
+
+  // Number of segments (power of two) for which the distance between the circle and 
+  // its polygon stays under the max_error, both in pixels
+  static int segments(const float radius, const float max_error = 0.25f) {
+    if (radius <= max_error) return 4;
+    const float needed = pi<float>() / acos(1 - max_error / radius);
+    int segments = 4;
+    while (segments < needed && segments < MAX_SEGMENTS) segments *= 2;
+    return segments;
+  }
+};
+
+// Unlike DrawCircleV which always uses the same number of segments, the number of segments
+// is chosen from the radius on the screen. Small circles are drawn with a few triangles
+// and large ones stay smooth.
+void draw_circle(const view& view, const vec2& center, const float radius, const Color& color) {
+  const unit_circle& circle = unit_circle::instance();
+  const Vector2 screen_center = view.transform(center);
+  const float screen_radius = view.transform(radius);
+  const int segments = unit_circle::segments(screen_radius);
+  const int step = unit_circle::MAX_SEGMENTS / segments;
+
+  // Center, then points counter-clockwise on the screen and the first point again to close the fan
+  Vector2 points[unit_circle::MAX_SEGMENTS + 2];
+  points[0] = screen_center;
+  for (int i = 0; i <= segments; i++) {
+    const vec2& point = circle.points[(i * step) % unit_circle::MAX_SEGMENTS];
+    points[i + 1] = Vector2{screen_center.x + point.x * screen_radius, screen_center.y - point.y * screen_radius};
+  }
+  DrawTriangleFan(points, segments + 2, color);
+}
+
 void draw_cylinder_guides(interface& interface, const view& view, engine& params) {
+  PROFILE_SCOPE(DRAW_CYLINDER_GUIDES);
   const Color active_color = Color{100, 100, 255, 255};
   const Color hover_color = Color{125, 125, 220, 255};
   const Color base_color = Color{150, 150, 175, 255};  
@@ -298,32 +4799,33 @@ void draw_cylinder_guides(interface& interface, const view& view, engine& params
   const float guide_origin_radius = 20;
 
   // Get position of the mouse in world coordinates
-  const vec2 mouse_position = view.inverse_transform(GetMousePosition());
+  const vec2 mouse_position = view.inverse_transform(interface.input.mouse_position());
+  // States shown while scrubbing come from the history and were solved with the geometry of their time,
+  // so the guides can't be dragged until the simulation continues from the shown state
+  const bool editable = interface.history_offset == 0;
 
   // User is moving the origin position of the cylinder guide
-  const interface::component position_component = interface::component::CYLINDER_GUIDE_POSITION;
-  const bool guide_position_hover = length(mouse_position - origin) < guide_origin_radius;
-  if (guide_position_hover) {
+  const interface::handle_id position_handle = interface::handle(interface::component::CYLINDER_GUIDE_POSITION);
+  if (editable && interface.add_handle(position_handle, origin, guide_origin_radius)) {
     position_color = hover_color;
-    interface.set_cursor(position_component, MOUSE_CURSOR_POINTING_HAND);
-    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT))
-      interface.set_active(position_component);
+    interface.set_cursor(position_handle, MOUSE_CURSOR_POINTING_HAND);
+    if (interface.input.mouse_down())
+      interface.set_active(position_handle);
   }
-  if (interface.is_active(position_component)) {
+  if (editable && interface.is_active(position_handle)) {
     position_color = active_color;
     origin = mouse_position;
   } 
 
   // User is moving the direction of the cylinder guide
-  const interface::component direction_component = interface::component::CYLINDER_GUIDE_DIRECTION;
-  const bool guide_direction_hover = length(mouse_position - display_direction) < guide_origin_radius * 2;
-  if (guide_direction_hover) {
+  const interface::handle_id direction_handle = interface::handle(interface::component::CYLINDER_GUIDE_DIRECTION);
+  if (editable && interface.add_handle(direction_handle, display_direction, guide_origin_radius * 2)) {
     direction_color = hover_color;
-    interface.set_cursor(direction_component, MOUSE_CURSOR_POINTING_HAND);
-    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT))
-      interface.set_active(direction_component);
+    interface.set_cursor(direction_handle, MOUSE_CURSOR_POINTING_HAND);
+    if (interface.input.mouse_down())
+      interface.set_active(direction_handle);
   }
-  if (interface.is_active(direction_component)) {
+  if (editable && interface.is_active(direction_handle)) {
     direction_color = active_color;
     direction = normalize(mouse_position - origin);
   } 
@@ -336,11 +4838,12 @@ void draw_cylinder_guides(interface& interface, const view& view, engine& params
   draw_arrow(view, origin, display_direction, 20, 40, 30, direction_color);
 
   // Draw the origin position of the cylinder guide
-  DrawCircleV(view.transform(origin), view.transform(guide_origin_radius), position_color);
-  DrawCircleV(view.transform(origin), view.transform(guide_origin_radius * 0.8), WHITE);
+  draw_circle(view, origin, guide_origin_radius, position_color);
+  draw_circle(view, origin, guide_origin_radius * 0.8, WHITE);
 }
 
 void draw_coordinates(const view& view) {
+  PROFILE_SCOPE(DRAW_COORDINATES);
   const Color color{0, 0, 0, 25};
   const float size = view.inverse_transform(1000);
   DrawLineV(view.transform(vec2(-size, 0)), view.transform(vec2(size, 0)), color);
@@ -353,29 +4856,248 @@ void draw_coordinates(const view& view) {
 }
 
 void draw_crankshaft(const view& view, const engine& engine) {
+  PROFILE_SCOPE(DRAW_CRANKSHAFT);
   const Color color{50, 50, 200, 255};
   const vec2 origin = vec2(0, 0);
-  const float bearing_size = 10;
+  const float bearing_size = engine.parts.bearing_radius;
 
-  DrawCircleV(view.transform(origin), view.transform(bearing_size), color);
-  draw_rectangle(view, origin, engine.crankshaft.crankpin_position, 10, color);
-  DrawCircleV(view.transform(engine.crankshaft.crankpin_position), view.transform(bearing_size), color);
+  draw_circle(view, origin, bearing_size, color);
+  draw_rectangle(view, origin, engine.crankshaft.crankpin_position, engine.parts.crank_web_width, color);
+  draw_circle(view, engine.crankshaft.crankpin_position, bearing_size, color);
 }
 
 void draw_connecting_rod(const view& view, const engine& engine) {
+  PROFILE_SCOPE(DRAW_CONNECTING_ROD);
   const Color color{200, 50, 50, 255};
-  const float bearing_size = 10;
+  const float bearing_size = engine.parts.bearing_radius;
 
-  DrawCircleV(view.transform(engine.crankshaft.crankpin_position), view.transform(bearing_size), color);
-  draw_rectangle(view, engine.crankshaft.crankpin_position, engine.piston.position, 10, color);
-  DrawCircleV(view.transform(engine.piston.position), view.transform(bearing_size), color);
+  draw_circle(view, engine.crankshaft.crankpin_position, bearing_size, color);
+  draw_rectangle(view, engine.crankshaft.crankpin_position, engine.piston.position, engine.parts.connecting_rod_width, color);
+  draw_circle(view, engine.piston.position, bearing_size, color);
 }
 
 void draw_piston(const view& view, const engine& engine) {
+  PROFILE_SCOPE(DRAW_PISTON);
   const Color color{50, 200, 50, 255};
-  const float piston_length = 30;
   const vec2 start = engine.piston.position;
-  const vec2 end = engine.piston.position + normalize(engine.cylinder.direction) * piston_length;
+  const vec2 end = engine.piston.position + normalize(engine.cylinder.direction) * engine.parts.piston_length;
+
+  draw_rectangle(view, start, end, engine.parts.piston_width, color);
+}
+
+// Draws the crankshaft, the connecting rod and the piston at every position of the motion blur
+// as a single batch of triangles. Every position is drawn semi-transparent, so together they
+// look like a long exposure: the parts are solid where they stay and faint where they move fast.
+void draw_motion_blur(const view& view, const engine& engine, const motion_blur& blur) {
+  PROFILE_SCOPE(DRAW_MOTION_BLUR);
+  const unit_circle& circle = unit_circle::instance();
+  const float bearing_size = engine.parts.bearing_radius;
+  const int segments = unit_circle::segments(view.transform(bearing_size));
+  const int step = unit_circle::MAX_SEGMENTS / segments;
+  const vec2 cylinder_direction = normalize(engine.cylinder.direction);
+  const int samples = (int) blur.angles.size();
+  // Alpha for which all positions together cover 95%
+  const unsigned char alpha = (unsigned char) clamp((int) (255 * (1 - pow(0.05f, 1.f / samples))), 1, 255);
+
+  Color color = WHITE;
+  // Triangles have to be counter-clockwise on the screen, otherwise they are culled
+  const auto triangle = [&](const vec2& a, const vec2& b, const vec2& c) {
+    const Vector2 p[3] = { view.transform(a), view.transform(b), view.transform(c) };
+    const bool clockwise = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x) > 0;
+    for (int i = 0; i < 3; i++) {
+      const Vector2& v = p[clockwise ? 2 - i : i];
+      rlColor4ub(color.r, color.g, color.b, alpha);
+      rlVertex2f(v.x, v.y);
+    }
+  };
+  const auto rectangle = [&](const vec2& start, const vec2& end, const float width) {
+    const vec2 direction = end - start;
+    const vec2 normal = normalize(vec2(-direction.y, direction.x)) * (width / 2);
+    triangle(start + normal, start - normal, end + normal);
+    triangle(start - normal, end - normal, end + normal);
+  };
+  const auto bearing = [&](const vec2& center) {
+    for (int i = 0; i < segments; i++) {
+      const vec2& a = circle.points[i * step];
+      const vec2& b = circle.points[((i + 1) * step) % unit_circle::MAX_SEGMENTS];
+      triangle(center, center + a * bearing_size, center + b * bearing_size);
+    }
+  };
+
+  // The main bearing doesn't move
+  draw_circle(view, vec2(0, 0), bearing_size, Color{50, 50, 200, 255});
+  // 2 bearings and 3 rectangles per position
+  const int vertices = 3 * (2 * segments + 6);
+  for (int i = 0; i < samples; i++) {
+    // Flushes the batch only if the next position doesn't fit into it
+    rlCheckRenderBatchLimit(vertices);
+    rlBegin(RL_TRIANGLES);
+    color = Color{50, 50, 200, 255};
+    rectangle(vec2(0, 0), blur.crankpins[i], engine.parts.crank_web_width);
+    // The connecting rod covers the crankpin when it exists
+    if (blur.exists[i]) color = Color{200, 50, 50, 255};
+    bearing(blur.crankpins[i]);
+    if (blur.exists[i]) {
+      rectangle(blur.crankpins[i], blur.pistons[i], engine.parts.connecting_rod_width);
+      bearing(blur.pistons[i]);
+      color = Color{50, 200, 50, 255};
+      rectangle(blur.pistons[i], blur.pistons[i] + cylinder_direction * engine.parts.piston_length, engine.parts.piston_width);
+    }
+    rlEnd();
+  }
+}
+
+// All segments of all trails are streamed into the render batch as lines, which is drawn with
+// a single draw call unless the trails are larger than the batch. Segments fade out with their age.
+void draw_trails(const view& view, const trails& trails, const history& history, const size_t history_offset) {
+  PROFILE_SCOPE(DRAW_TRAILS);
+  const size_t available = history.size() - std::min(history.size(), history_offset);
+  const int length = (int) std::min<size_t>(trails.length, available);
+  if (length < 2) return;
+  // Batch is checked for every chunk of segments instead of every segment
+  const int CHUNK = 1024;
+
+  for (const float t: trails.rod_points) {
+    // Color of the part on which the point is
+    const Color color = t <= 0 ? Color{50, 50, 200, 255} : t >= 1 ? Color{50, 200, 50, 255} : Color{200, 50, 50, 255};
+    const auto point = [&](const int age, bool& exists) {
+      const history::state& s = history.at(history_offset + age);
+      exists = s.exists || t <= 0;
+      const vec2 crankpin = vec2(s.crankpin_x, s.crankpin_y) * history::POSITION_STEP;
+      const vec2 piston = vec2(s.piston_x, s.piston_y) * history::POSITION_STEP;
+      return view.transform(mix(crankpin, piston, t));
+    };
+
+    bool exists = false;
+    Vector2 previous = point(0, exists);
+    bool previous_exists = exists;
+    for (int start = 1; start < length; start += CHUNK) {
+      const int end = std::min(length, start + CHUNK);
+      rlCheckRenderBatchLimit(2 * (end - start));
+      rlBegin(RL_LINES);
+      for (int age = start; age < end; age++) {
+        const Vector2 current = point(age, exists);
+        if (exists && previous_exists) {
+          const unsigned char alpha = (unsigned char) (255 * (length - age) / length);
+          rlColor4ub(color.r, color.g, color.b, alpha);
+          rlVertex2f(previous.x, previous.y);
+          rlVertex2f(current.x, current.y);
+        }
+        previous = current;
+        previous_exists = exists;
+      }
+      rlEnd();
+    }
+  }
+}
+
+void draw_plot(interface& interface, const plot_history& plot) {
+  PROFILE_SCOPE(DRAW_PLOT);
+  const Rectangle panel{WINDOW_WIDTH - 410, WINDOW_HEIGHT - 240, 400, 230};
+  const Rectangle area{panel.x + 10, panel.y + 34, panel.width - 20, panel.height - 70};
+  const Color colors[plot_history::SIGNAL_COUNT] = { Color{50, 200, 50, 255}, Color{200, 50, 50, 255}, Color{50, 50, 200, 255} };
+  GuiPanel(panel, "Piston");
+
+  // raygui reads the mouse from raylib, which isn't recorded. The widgets are locked and only drawn,
+  // clicks and drags come from the input of the interface, so replays reproduce them.
+  const Vector2 mouse = interface.input.mouse_position();
+  GuiLock();
+  for (int s = 0; s < plot_history::SIGNAL_COUNT; s++) {
+    const Rectangle box{area.x + s * 120, panel.y + panel.height - 30, 12, 12};
+    // The label is clickable too
+    const Rectangle clickable{box.x, box.y, box.width + 4 + MeasureText(plot_history::SIGNAL_NAMES[s], 10), box.height};
+    const interface::handle_id signal_handle = interface::handle(interface::component::PLOT_SIGNAL, s);
+    if (interface.input.mouse_pressed() && interface.active_handle == 0 && CheckCollisionPointRec(mouse, clickable)) {
+      interface.set_active(signal_handle);
+      interface.plot_signals[s] = !interface.plot_signals[s];
+    }
+    GuiCheckBox(box, plot_history::SIGNAL_NAMES[s], &interface.plot_signals[s]);
+  }
+  const float longest = std::max(1.f, plot.count * SIMULATION_STEP);
+  const Rectangle slider{area.x + 50, panel.y + panel.height - 14, area.width - 120, 10};
+  const interface::handle_id window_handle = interface::handle(interface::component::PLOT_WINDOW);
+  if (interface.input.mouse_pressed() && CheckCollisionPointRec(mouse, slider))
+    interface.set_active(window_handle);
+  if (interface.is_active(window_handle))
+    interface.plot_window = 1 + clamp((mouse.x - slider.x) / slider.width, 0.f, 1.f) * (longest - 1);
+  interface.plot_window = std::min(interface.plot_window, longest);
+  GuiSliderBar(slider, "window", TextFormat("%.1f s", interface.plot_window), &interface.plot_window, 1, longest);
+  GuiUnlock();
+  if (plot.count < 2) return;
+
+  // One min/max pair per pixel column, every signal is scaled to the height of the plot
+  const int column_count = (int) area.width;
+  const size_t window = (size_t) (interface.plot_window / SIMULATION_STEP);
+  std::vector<plot_history::range> columns(column_count);
+  for (int s = 0; s < plot_history::SIGNAL_COUNT; s++) {
+    if (!interface.plot_signals[s]) continue;
+    plot.columns((plot_history::signal) s, window, column_count, columns.data());
+    plot_history::range scale{INFINITY, -INFINITY};
+    for (const plot_history::range& r: columns) {
+      scale.min = std::min(scale.min, r.min);
+      scale.max = std::max(scale.max, r.max);
+    }
+    const float height = std::max(scale.max - scale.min, EPSILON);
+    const auto y = [&](const float value) { return area.y + area.height * (1 - (value - scale.min) / height); };
+
+    const Color& color = colors[s];
+    rlCheckRenderBatchLimit(2 * column_count);
+    rlBegin(RL_LINES);
+    rlColor4ub(color.r, color.g, color.b, color.a);
+    for (int c = 0; c < column_count; c++) {
+      // At least one pixel high
+      rlVertex2f(area.x + c + 0.5f, y(columns[c].min) + 0.5f);
+      rlVertex2f(area.x + c + 0.5f, y(columns[c].max) - 0.5f);
+    }
+    rlEnd();
+    DrawText(TextFormat("%.1f", scale.max), area.x + 2 + s * 60, area.y, 10, color);
+    DrawText(TextFormat("%.1f", scale.min), area.x + 2 + s * 60, area.y + area.height - 10, 10, color);
+  }
+
+  // Position of the state shown while scrubbing
+  const size_t shown = std::min(window, plot.count);
+  if (interface.history_offset > 0 && interface.history_offset < shown) {
+    const float x = area.x + area.width * (1 - (float) interface.history_offset / shown);
+    DrawLineV(Vector2{x, area.y}, Vector2{x, area.y + area.height}, DARKGRAY);
+  }
+}
+
+void draw_trace_status(const trace_writer& trace) {
+  const async_file_writer::backpressure& metrics = trace.file.metrics;
+  DrawText(TextFormat("REC %llu samples | queue %d/%d | stalls %llu (%.1f ms)",
+    (unsigned long long) trace.header.sample_count, metrics.queue_depth.load(), (int) trace.file.buffers.size(),
+    (unsigned long long) metrics.stalls.load(), metrics.stall_nanoseconds.load() / 1e6), 10, 10, 10, DARKGRAY);
+}
+
+#ifdef PISTON_PROFILER
+void draw_profiler_overlay(const profiler& profiler) {
+  const int width = 260;
+  const int x = WINDOW_WIDTH - width - 10;
+  int y = 10;
+  DrawRectangle(x, y, width, 20 + 14 * profiler::STAGE_COUNT + 70, Color{255, 255, 255, 220});
+  DrawText("stage               p50 ms    p99 ms", x + 8, y + 6, 10, DARKGRAY);
+  y += 20;
+  for (int s = 0; s < profiler::STAGE_COUNT; s++, y += 14) {
+    DrawText(profiler::STAGE_NAMES[s], x + 8, y, 10, DARKGRAY);
+    DrawText(TextFormat("%7.3f", profiler.percentile(s, 0.5f)), x + 130, y, 10, DARKGRAY);
+    DrawText(TextFormat("%7.3f", profiler.percentile(s, 0.99f)), x + 190, y, 10, DARKGRAY);
+  }
 
-  draw_rectangle(view, start, end, 50, color);
-}
\ No newline at end of file
+  // Histogram of the frame times, one bin per millisecond
+  const int bins = 40;
+  int counts[bins] = {};
+  int highest = 1;
+  const int frames = (int) std::min<uint64_t>(profiler.frames, profiler::HISTORY);
+  for (int i = 0; i < frames; i++) {
+    const int bin = std::min(bins - 1, (int) profiler.history[profiler::FRAME][i]);
+    highest = std::max(highest, ++counts[bin]);
+  }
+  const int bar_width = (width - 16) / bins;
+  const int height = 50;
+  for (int b = 0; b < bins; b++) {
+    const int bar_height = counts[b] * height / highest;
+    DrawRectangle(x + 8 + b * bar_width, y + 4 + height - bar_height, bar_width - 1, bar_height, Color{100, 100, 255, 255});
+  }
+  DrawText(TextFormat("0 - %d ms, %d frames", bins, frames), x + 8, y + height + 6, 10, DARKGRAY);
+}
+#endif